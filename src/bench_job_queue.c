@@ -0,0 +1,306 @@
+// Benchmark for job_queue on its own, without any real work.
+//
+// Producers push timestamped elements as fast as they can and
+// consumers pop them, for each queue kind asked for.  Reports the
+// throughput in elements per second and percentiles of the handoff
+// latency, the time from the start of a push to the end of the pop
+// that got the element.  Reading the clock for every element costs
+// some throughput, equally for every kind.
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "job_queue.h"
+
+// Every consumer keeps the latencies of up to this many elements,
+// spread evenly over its share of the run
+#define MAX_SAMPLES (1 << 18)
+
+struct config {
+  int    producers;
+  int    consumers;
+  int    capacity;
+  size_t payload;     // element size; 0 for plain pointers
+  long   per_producer;
+  int    batch;       // elements per push_many/pop_many
+  int    stats;
+};
+
+struct consumer {
+  struct job_queue *jq;
+  struct config    *cfg;
+  long              popped;
+  long              sample_every;
+  long             *samples;
+  int               nsamples;
+  pthread_t         thread;
+};
+
+struct producer {
+  struct job_queue *jq;
+  struct config    *cfg;
+  pthread_t         thread;
+};
+
+// Released together, so that thread creation does not count
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The element size, for either kind of queue
+static size_t elem_size(struct config const *cfg) {
+  return cfg->payload > 0 ? cfg->payload : sizeof(void *);
+}
+
+static void *producer_main(void *arg) {
+  struct producer *p = arg;
+  struct config *cfg = p->cfg;
+  size_t size = elem_size(cfg);
+  char *batch = calloc(cfg->batch, size);
+  if (batch == NULL) {
+    err(1, "out of memory");
+  }
+  pthread_barrier_wait(&start_barrier);
+  for (long i = 0; i < cfg->per_producer; i += cfg->batch) {
+    int n = cfg->per_producer - i < cfg->batch ? cfg->per_producer - i : cfg->batch;
+    uint64_t t = now_ns();
+    // The timestamp is the pointer itself, or the start of the
+    // element
+    for (int j = 0; j < n; j++) {
+      if (cfg->payload > 0) {
+        memcpy(batch + j * size, &t, sizeof(t));
+      } else {
+        ((void **)batch)[j] = (void *)(uintptr_t)t;
+      }
+    }
+    int pushed = cfg->payload > 0
+      ? job_queue_push_values(p->jq, batch, NULL, n)
+      : job_queue_push_many(p->jq, (void **)batch, n);
+    if (pushed != n) {
+      errx(1, "push failed");
+    }
+  }
+  free(batch);
+  return NULL;
+}
+
+static void *consumer_main(void *arg) {
+  struct consumer *c = arg;
+  struct config *cfg = c->cfg;
+  size_t size = elem_size(cfg);
+  char *batch = calloc(cfg->batch, size);
+  if (batch == NULL) {
+    err(1, "out of memory");
+  }
+  pthread_barrier_wait(&start_barrier);
+  for (;;) {
+    int n = cfg->payload > 0
+      ? job_queue_pop_values(c->jq, batch, cfg->batch)
+      : job_queue_pop_many(c->jq, (void **)batch, cfg->batch);
+    if (n < 0) {
+      break;
+    }
+    uint64_t t = now_ns();
+    for (int j = 0; j < n; j++) {
+      if ((c->popped + j) % c->sample_every == 0 && c->nsamples < MAX_SAMPLES) {
+        uint64_t pushed_at;
+        if (cfg->payload > 0) {
+          memcpy(&pushed_at, batch + j * size, sizeof(pushed_at));
+        } else {
+          pushed_at = (uintptr_t)((void **)batch)[j];
+        }
+        c->samples[c->nsamples++] = t - pushed_at;
+      }
+    }
+    c->popped += n;
+  }
+  free(batch);
+  return NULL;
+}
+
+static int cmp_long(void const *a, void const *b) {
+  long x = *(long const *)a;
+  long y = *(long const *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile_us(long *sorted, long n, double p) {
+  if (n == 0) {
+    return 0;
+  }
+  long i = (long)(p * (n - 1));
+  return sorted[i] / 1e3;
+}
+
+// Run the benchmark for one kind and print a line of results.
+static void bench_kind(enum job_queue_kind kind, struct config *cfg) {
+  struct job_queue_attr attr;
+  job_queue_attr_init(&attr);
+  attr.kind = kind;
+  attr.elem_size = cfg->payload;
+  attr.stats = cfg->stats;
+  struct job_queue jq;
+  if (job_queue_init_attr(&jq, cfg->capacity, &attr) != 0) {
+    errx(1, "job_queue_init_attr() failed for %s", job_queue_kind_name(kind));
+  }
+
+  long total = cfg->per_producer * cfg->producers;
+  long expected = total / cfg->consumers + 1;
+  struct producer *producers = calloc(cfg->producers, sizeof(struct producer));
+  struct consumer *consumers = calloc(cfg->consumers, sizeof(struct consumer));
+  long *samples = malloc(sizeof(long) * MAX_SAMPLES * cfg->consumers);
+  if (producers == NULL || consumers == NULL || samples == NULL) {
+    err(1, "out of memory");
+  }
+  pthread_barrier_init(&start_barrier, NULL, cfg->producers + cfg->consumers + 1);
+  for (int i = 0; i < cfg->consumers; i++) {
+    struct consumer *c = &consumers[i];
+    c->jq = &jq;
+    c->cfg = cfg;
+    c->sample_every = expected / MAX_SAMPLES + 1;
+    c->samples = samples + (long)i * MAX_SAMPLES;
+    if (pthread_create(&c->thread, NULL, consumer_main, c) != 0) {
+      err(1, "pthread_create() failed");
+    }
+  }
+  for (int i = 0; i < cfg->producers; i++) {
+    struct producer *p = &producers[i];
+    p->jq = &jq;
+    p->cfg = cfg;
+    if (pthread_create(&p->thread, NULL, producer_main, p) != 0) {
+      err(1, "pthread_create() failed");
+    }
+  }
+
+  pthread_barrier_wait(&start_barrier);
+  uint64_t start = now_ns();
+  for (int i = 0; i < cfg->producers; i++) {
+    pthread_join(producers[i].thread, NULL);
+  }
+  // Lets the consumers drain the queue, then stop
+  job_queue_destroy(&jq);
+  long popped = 0;
+  long nsamples = 0;
+  for (int i = 0; i < cfg->consumers; i++) {
+    pthread_join(consumers[i].thread, NULL);
+    popped += consumers[i].popped;
+    memmove(samples + nsamples, consumers[i].samples,
+            sizeof(long) * consumers[i].nsamples);
+    nsamples += consumers[i].nsamples;
+  }
+  double secs = (now_ns() - start) / 1e9;
+  pthread_barrier_destroy(&start_barrier);
+  if (popped != total) {
+    errx(1, "%s: popped %ld of %ld elements", job_queue_kind_name(kind), popped, total);
+  }
+
+  qsort(samples, nsamples, sizeof(long), cmp_long);
+  printf("%-10s %10.2f Mops/s   p50 %9.2f us   p99 %9.2f us   max %9.2f us\n",
+         job_queue_kind_name(kind), total / secs / 1e6,
+         percentile_us(samples, nsamples, 0.50),
+         percentile_us(samples, nsamples, 0.99),
+         percentile_us(samples, nsamples, 1.0));
+  if (cfg->stats) {
+    struct job_queue_stats stats;
+    if (job_queue_stats(&jq, &stats) == 0) {
+      job_queue_stats_print(stdout, &stats);
+    }
+  }
+  free(samples);
+  free(consumers);
+  free(producers);
+}
+
+int main(int argc, char * const *argv) {
+  struct config cfg = {
+    .producers = 1,
+    .consumers = 1,
+    .capacity = 64,
+    .payload = 0,
+    .per_producer = 1000000,
+    .batch = 1,
+    .stats = 0,
+  };
+  char const *kinds = "all";
+  char const *usage =
+    "usage: [-p PRODUCERS] [-c CONSUMERS] [-k CAPACITY] [-e BYTES] [-n PER_PRODUCER]\n"
+    "       [-b BATCH] [-q KIND[,KIND...]|all] [-s]";
+  int opt;
+  while ((opt = getopt(argc, argv, "p:c:k:e:n:b:q:s")) != -1) {
+    switch (opt) {
+    case 'p':
+      cfg.producers = atoi(optarg);
+      break;
+    case 'c':
+      cfg.consumers = atoi(optarg);
+      break;
+    case 'k':
+      cfg.capacity = atoi(optarg);
+      break;
+    case 'e':
+      cfg.payload = atol(optarg);
+      break;
+    case 'n':
+      cfg.per_producer = atol(optarg);
+      break;
+    case 'b':
+      cfg.batch = atoi(optarg);
+      break;
+    case 'q':
+      kinds = optarg;
+      break;
+    case 's':
+      cfg.stats = 1;
+      break;
+    default:
+      errx(1, "%s", usage);
+    }
+  }
+  if (cfg.producers < 1 || cfg.consumers < 1 || cfg.capacity < 1 ||
+      cfg.per_producer < 1 || cfg.batch < 1 ||
+      (cfg.payload > 0 && cfg.payload < sizeof(uint64_t))) {
+    errx(1, "%s", usage);
+  }
+
+  printf("%d producers, %d consumers, capacity %d, %zu-byte elements, batch %d, %ld elements\n",
+         cfg.producers, cfg.consumers, cfg.capacity, elem_size(&cfg), cfg.batch,
+         cfg.per_producer * cfg.producers);
+  if (strcmp(kinds, "all") == 0) {
+    // Every kind that is correct for these thread counts
+    for (int k = 0; strcmp(job_queue_kind_name(k), "unknown") != 0; k++) {
+      if ((k == JOB_QUEUE_SPMC || k == JOB_QUEUE_SPSC) && cfg.producers > 1) {
+        continue;
+      }
+      if (k == JOB_QUEUE_SPSC && cfg.consumers > 1) {
+        continue;
+      }
+      bench_kind(k, &cfg);
+    }
+    return 0;
+  }
+  char *list = strdup(kinds);
+  if (list == NULL) {
+    err(1, "out of memory");
+  }
+  for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+    enum job_queue_kind kind;
+    if (job_queue_kind_parse(name, &kind) != 0) {
+      errx(1, "unknown queue kind: %s", name);
+    }
+    bench_kind(kind, &cfg);
+  }
+  free(list);
+  return 0;
+}
@@ -6,26 +6,184 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <fts.h>
+#include <limits.h>
+#include <time.h>
 
 // err.h contains various nonstandard BSD extensions, but they are
 // very handy.
 #include <err.h>
 
 #include <pthread.h>
+#include <stdarg.h>
+#include <unistd.h>
 
-#include "job_queue.h"
+#include "thread_pool.h"
+#include "path_job.h"
+#include "reorder.h"
+#include "topology.h"
+#include "green.h"
+#include "shm_queue.h"
 
 // ---------- Global shared state ----------
 
 pthread_mutex_t stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Taken to write out matches.  With -f, worker processes share one in
+// shared memory instead, which is robust: a worker that dies holding it
+// leaves at worst a partly written line, and the next one takes over.
+static pthread_mutex_t *g_out_mutex = &stdout_mutex;
+static int g_procs = 0;
+
 static char const *g_needle = NULL;
 
-int fauxgrep_file(char const *needle, char const *path) {
+// With -m, the search stops after this many matching lines (0 means
+// no limit).  The pool is needed to cancel the jobs still queued.
+static long g_max_matches = 0;
+static long g_matches = 0;
+static int g_stopped = 0;
+static struct thread_pool *g_pool = NULL;
+
+// Paths are handed to the job queue in batches, so that walking a tree
+// of many small files costs one lock acquisition per batch rather than
+// per file.  Workers take a few at a time for the same reason, but not
+// so many that one worker hoards the work.
+#define PUSH_BATCH 32
+#define POP_BATCH  4
+
+// With -q segmented the walker may run this many paths ahead of the
+// workers, rather than stopping whenever they fall behind.
+#define WALK_AHEAD (64 * 1024)
+
+// Matches are collected in a per-worker buffer, which is written to
+// stdout when it grows past this size or when the worker runs out of
+// jobs, instead of taking stdout_mutex for every matching line.
+#define OUT_FLUSH (64 * 1024)
+
+// ---------- Output buffering ----------
+
+struct outbuf {
+  char  *data;
+  size_t len;
+  size_t cap;
+  int    hold;    // never flush; the output goes to the reorder buffer
+};
+
+// Write out and empty the buffer.
+static void out_flush(struct outbuf *out) {
+  if (out->len == 0) {
+    return;
+  }
+  int r = pthread_mutex_lock(g_out_mutex);
+  if (r == EOWNERDEAD) {
+    r = pthread_mutex_consistent(g_out_mutex);
+  }
+  assert(r == 0);
+  fwrite(out->data, 1, out->len, stdout);
+  if (g_procs > 0) {
+    // Other processes have their own stdio buffers
+    fflush(stdout);
+  }
+  assert(pthread_mutex_unlock(g_out_mutex) == 0);
+  out->len = 0;
+}
+
+// Append formatted text to the buffer, growing it as needed.
+static void out_printf(struct outbuf *out, char const *fmt, ...) {
+  for (;;) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(out->data + out->len, out->cap - out->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+      return;
+    }
+    if ((size_t)n < out->cap - out->len) {
+      out->len += n;
+      break;
+    }
+    size_t cap = out->cap * 2 > out->len + n + 1 ? out->cap * 2 : out->len + n + 1;
+    char *data = realloc(out->data, cap);
+    if (data == NULL) {
+      err(1, "out of memory buffering output");
+    }
+    out->data = data;
+    out->cap = cap;
+  }
+  if (out->len >= OUT_FLUSH && !out->hold) {
+    out_flush(out);
+  }
+}
+
+// ---------- Stopping early ----------
+
+static int stopped(void) {
+  return __atomic_load_n(&g_stopped, __ATOMIC_RELAXED);
+}
+
+// ---------- Ordered output ----------
+
+// With -o, matches are printed in the order the walk found the files.
+// Each job collects its file's matches and hands them to a reorder
+// buffer, which holds the output of up to this many files.  It must be
+// larger than PUSH_BATCH (see reorder.h).
+#define ORDER_WINDOW 1024
+
+static int g_ordered = 0;
+static struct reorder g_reorder;
+
+struct file_job {
+  struct path_job path;
+  unsigned long   ticket;   // with -o
+};
+
+static void emit_output(void *result, void *arg) {
+  (void)arg;
+  struct outbuf *out = result;
+  out_flush(out);
+  free(out->data);
+}
+
+// Hand in the output for a job, even if it produced none, so that the
+// output of later jobs is not held up.
+static void finish_job(struct file_job *gj, struct outbuf *out) {
+  if (g_ordered) {
+    struct outbuf none = { NULL, 0, 0, 1 };
+    reorder_done(&g_reorder, gj->ticket, out != NULL ? out : &none);
+  }
+  path_job_free(&gj->path);
+}
+
+static void free_path(void *job) {
+  finish_job(job, NULL);
+}
+
+// Claim one of the matching lines we may still print.  Whoever claims
+// the last one stops the search: queued files are dropped, and the
+// walker and the other workers notice 'g_stopped'.
+static int take_match(void) {
+  if (g_max_matches == 0) {
+    return 1;
+  }
+  long n = __atomic_add_fetch(&g_matches, 1, __ATOMIC_RELAXED);
+  if (n == g_max_matches) {
+    __atomic_store_n(&g_stopped, 1, __ATOMIC_RELAXED);
+    // Green tasks still queued notice 'g_stopped' when they start
+    if (g_pool != NULL) {
+      thread_pool_cancel(g_pool, free_path);
+    }
+  }
+  return n <= g_max_matches;
+}
+
+int fauxgrep_file(char const *needle, char const *path, struct outbuf *out) {
   FILE *f = fopen(path, "r");
   if (f == NULL) {
     assert(pthread_mutex_lock(&stdout_mutex) == 0);
@@ -37,11 +195,12 @@ int fauxgrep_file(char const *needle, char const *path) {
   char *line = NULL;
   size_t linelen = 0;
   int lineno = 0;
-  while (getline(&line, &linelen, f) != -1) {
+  while (!stopped() && getline(&line, &linelen, f) != -1) {
     if (strstr(line, needle) != NULL) {
-      assert(pthread_mutex_lock(&stdout_mutex) == 0);
-      printf("%s:%d:%s", path, lineno, line);
-      assert(pthread_mutex_unlock(&stdout_mutex) == 0);
+      if (!take_match()) {
+        break;
+      }
+      out_printf(out, "%s:%d:%s", path, lineno, line);
     }
     lineno++;
   }
@@ -51,58 +210,445 @@ int fauxgrep_file(char const *needle, char const *path) {
   return 0;
 }
 
-// ---------- Worker thread ----------
+// ---------- Green tasks ----------
+
+// With -g, every file is searched by a green task (see green.h), so
+// that while one waits for its file to be read the thread searches
+// others.  getline() would block the thread, so the file is read with
+// green_pread() and split into lines here.
+
+static int g_green = 0;
+
+// Bytes read at a time
+#define READ_CHUNK (64 * 1024)
 
-void *worker(void *arg) {
-    struct job_queue *jq = (struct job_queue *)arg;
-    void *data;
-    while (job_queue_pop(jq, &data) == 0) {
-        char *filepath = data;
-        fauxgrep_file(g_needle, filepath);
-        free(filepath);
+struct line_reader {
+  int    fd;
+  off_t  offset;      // in the file, of buf + len
+  char  *buf;
+  size_t cap;         // always more than 'len', for the terminating NUL
+  size_t len;
+  size_t start;       // of the next line
+  char   saved;       // the byte the last line's NUL replaced
+  int    held;        // 'saved' must be put back
+  int    eof;
+};
+
+// Returns the next line, with its newline and NUL-terminated as for
+// getline(), or NULL at the end of the file or on error.  The line is
+// valid until the next call.
+static char *read_line(struct line_reader *r) {
+  if (r->held) {
+    r->buf[r->start] = r->saved;
+    r->held = 0;
+  }
+  for (;;) {
+    char *line = r->buf + r->start;
+    size_t avail = r->len - r->start;
+    char *nl = memchr(line, '\n', avail);
+    if (nl != NULL || (r->eof && avail > 0)) {
+      r->start += nl != NULL ? (size_t)(nl + 1 - line) : avail;
+      r->saved = r->buf[r->start];
+      r->held = 1;
+      r->buf[r->start] = '\0';
+      return line;
+    }
+    if (r->eof) {
+      return NULL;
+    }
+    // Keep the partial line, and make room to read more of it
+    memmove(r->buf, line, avail);
+    r->len = avail;
+    r->start = 0;
+    if (r->cap - r->len <= READ_CHUNK / 2) {
+      char *buf = realloc(r->buf, r->cap * 2);
+      if (buf == NULL) {
+        err(1, "out of memory reading a line");
+      }
+      r->buf = buf;
+      r->cap *= 2;
     }
-    return NULL;
+    ssize_t n = green_pread(r->fd, r->buf + r->len, r->cap - r->len - 1, r->offset);
+    if (n < 0) {
+      return NULL;
+    }
+    r->eof = n == 0;
+    r->len += n;
+    r->offset += n;
+  }
 }
 
-// ---------- Main ----------
+// fauxgrep_file(), reading through green_pread().
+static int fauxgrep_file_green(char const *needle, char const *path, struct outbuf *out) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    assert(pthread_mutex_lock(&stdout_mutex) == 0);
+    warn("failed to open %s", path);
+    assert(pthread_mutex_unlock(&stdout_mutex) == 0);
+    return -1;
+  }
 
-int main(int argc, char * const *argv) {
-  if (argc < 2) {
-        err(1, "usage: [-n INT] STRING paths...");
+  struct line_reader r = { fd, 0, malloc(READ_CHUNK), READ_CHUNK, 0, 0, 0, 0, 0 };
+  if (r.buf == NULL) {
+    err(1, "out of memory reading %s", path);
+  }
+  char *line;
+  int lineno = 0;
+  while (!stopped() && (line = read_line(&r)) != NULL) {
+    if (strstr(line, needle) != NULL) {
+      if (!take_match()) {
+        break;
+      }
+      out_printf(out, "%s:%d:%s", path, lineno, line);
     }
+    lineno++;
+  }
+
+  free(r.buf);
+  close(fd);
+  return 0;
+}
+
+// A green task owns its file_job, and collects its matches in its own
+// buffer.
+static void grep_task(void *arg) {
+  struct file_job *gj = arg;
+  struct outbuf out = { NULL, 0, 0, g_ordered };
+  if (!stopped()) {
+    fauxgrep_file_green(g_needle, path_job_path(&gj->path), &out);
+  }
+  if (g_ordered) {
+    finish_job(gj, &out);
+  } else {
+    out_flush(&out);
+    free(out.data);
+    finish_job(gj, NULL);
+  }
+  free(gj);
+}
+
+// ---------- Worker processes ----------
+
+// With -f, the walker forks worker processes and hands them paths
+// through a shm_queue (see shm_queue.h).  Each worker is
+// single-threaded, and writes out the matches of each file as soon as
+// it is done with it, so a worker that crashes takes down only itself
+// and the file it was searching.
 
+// Bytes of paths that may be queued
+#define SHM_QUEUE_SIZE (1024 * 1024)
+
+// How long the walker waits for room before checking that there are
+// still workers to make it
+#define PUSH_PATIENCE_MS 1000
+
+static void proc_worker(struct shm_queue *q, char const *needle) {
+  size_t cap = shm_queue_max_elem(q);
+  char *path = malloc(cap + 1);
+  if (path == NULL) {
+    err(1, "out of memory");
+  }
+  struct outbuf out = { NULL, 0, 0, 0 };
+  ssize_t len;
+  while ((len = shm_queue_pop(q, path, cap)) >= 0) {
+    path[len] = '\0';
+    fauxgrep_file(needle, path, &out);
+    out_flush(&out);
+  }
+  free(out.data);
+  free(path);
+}
+
+// Reap the workers that have exited, reporting those that crashed.
+// With 'block', wait for all of them.  Returns the number still
+// running, and sets '*crashed' if any crashed.
+static int reap_workers(pid_t *pids, int *crashed, int block) {
+  int running = 0;
+  for (int i = 0; i < g_procs; i++) {
+    if (pids[i] == 0) {
+      continue;
+    }
+    int status;
+    pid_t r = waitpid(pids[i], &status, block ? 0 : WNOHANG);
+    if (r == 0) {
+      running++;
+      continue;
+    }
+    if (r == pids[i] && WIFSIGNALED(status)) {
+      warnx("worker process %d killed by signal %d", (int)r, WTERMSIG(status));
+      *crashed = 1;
+    } else if (r == pids[i] && WEXITSTATUS(status) != 0) {
+      *crashed = 1;
+    }
+    pids[i] = 0;
+  }
+  return running;
+}
+
+// The whole search with -f: returns the exit status.
+static int grep_procs(char const *needle, char * const *paths) {
+  struct shm_queue *q = shm_queue_create(NULL, SHM_QUEUE_SIZE);
+  if (q == NULL) {
+    err(1, "shm_queue_create() failed");
+  }
+  pthread_mutexattr_t mattr;
+  g_out_mutex = mmap(NULL, sizeof(pthread_mutex_t), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (g_out_mutex == MAP_FAILED ||
+      pthread_mutexattr_init(&mattr) != 0 ||
+      pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED) != 0 ||
+      pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST) != 0 ||
+      pthread_mutex_init(g_out_mutex, &mattr) != 0) {
+    err(1, "setting up the output lock failed");
+  }
+  pthread_mutexattr_destroy(&mattr);
+
+  pid_t *pids = calloc(g_procs, sizeof(pid_t));
+  if (pids == NULL) {
+    err(1, "out of memory");
+  }
+  fflush(stdout);
+  for (int i = 0; i < g_procs; i++) {
+    pids[i] = fork();
+    if (pids[i] < 0) {
+      err(1, "fork() failed");
+    }
+    if (pids[i] == 0) {
+      proc_worker(q, needle);
+      exit(0);
+    }
+  }
+
+  int crashed = 0;
+  FTS *ftsp = fts_open(paths, FTS_LOGICAL | FTS_NOCHDIR, NULL);
+  if (ftsp == NULL) {
+    shm_queue_close(q);
+    reap_workers(pids, &crashed, 1);
+    err(1, "fts_open() failed");
+  }
+  FTSENT *entry;
+  while ((entry = fts_read(ftsp)) != NULL) {
+    if (entry->fts_info != FTS_F) {
+      continue;
+    }
+    for (;;) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += PUSH_PATIENCE_MS / 1000;
+      deadline.tv_nsec += PUSH_PATIENCE_MS % 1000 * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      int r = shm_queue_push_timed(q, entry->fts_path, entry->fts_pathlen, &deadline);
+      if (r < 0) {
+        warnx("path too long to queue: %s", entry->fts_path);
+      }
+      if (r <= 0) {
+        break;
+      }
+      // The queue stays full: make sure someone is still popping
+      if (reap_workers(pids, &crashed, 0) == 0) {
+        errx(1, "every worker process has exited");
+      }
+    }
+  }
+  fts_close(ftsp);
+
+  shm_queue_close(q);
+  reap_workers(pids, &crashed, 1);
+  free(pids);
+  shm_queue_detach(q);
+  return crashed ? 1 : 0;
+}
+
+// ---------- Workers ----------
+
+// Every worker collects its matches in its own buffer, its context in
+// the thread pool.
+static int worker_init(struct thread_pool_worker *worker) {
+    worker->ctx = calloc(1, sizeof(struct outbuf));
+    return worker->ctx == NULL ? -1 : 0;
+}
+
+// Idle: a good moment to write out what we have found
+static void worker_idle(struct thread_pool_worker *worker) {
+    out_flush(worker->ctx);
+}
+
+static void worker_fini(struct thread_pool_worker *worker) {
+    struct outbuf *out = worker->ctx;
+    out_flush(out);
+    free(out->data);
+    free(out);
+}
+
+static void grep_job(struct thread_pool_worker *worker, void *job) {
+    struct file_job *gj = job;
+    struct outbuf own = { NULL, 0, 0, 1 };
+    struct outbuf *out = g_ordered ? &own : worker->ctx;
+    // Jobs that were already taken (or, with work stealing, never
+    // cancelled) when the search stopped are skipped
+    if (!stopped()) {
+        fauxgrep_file(g_needle, path_job_path(&gj->path), out);
+    }
+    finish_job(gj, g_ordered ? out : NULL);
+}
+
+// Report on the job queue to stderr, so that a run with -s shows
+// whether the workers starved (slept for elements), the walker was
+// held up (slept for room), or the queue lock itself was contended.
+// With -g, 'pool' is NULL and the queue is that of the green threads.
+static void print_queue_stats(struct thread_pool *pool, struct job_queue *green_queue) {
+    struct job_queue_stats stats;
+    if (pool == NULL) {
+        job_queue_stats(green_queue, &stats);
+        job_queue_stats_print(stderr, &stats);
+        return;
+    }
+    if (thread_pool_stats(pool, &stats) != 0) {
+        warnx("no job queue statistics with work stealing");
+        return;
+    }
+    job_queue_stats_print(stderr, &stats);
+    if (pool->attr.max_workers > pool->nworkers) {
+        fprintf(stderr, "workers: %d at most\n", pool->peak);
+    }
+}
+
+// ---------- Main ----------
+
+int main(int argc, char * const *argv) {
     int num_threads = 1;
-    char const *needle;
-    char * const *paths;
-    // Parse optional "-n k" flag for number of threads
-    if (argc > 3 && strcmp(argv[1], "-n") == 0) {
-        num_threads = atoi(argv[2]);
-        if (num_threads < 1) {
-            err(1, "invalid thread count: %s", argv[2]);
+    int print_stats = 0;
+    struct thread_pool_attr attr;
+    thread_pool_attr_init(&attr);
+    attr.batch = POP_BATCH;
+    attr.job_size = sizeof(struct file_job);
+    attr.worker_init = worker_init;
+    attr.worker_idle = worker_idle;
+    attr.worker_fini = worker_fini;
+    int *pin_cpus = NULL;
+    int green_tasks = 0;
+    int threads_set = 0;
+    int queue_set = 0;
+    // Parse options; the leading '+' stops at the search string, so a
+    // needle that starts with '-' must follow "--"
+    int opt;
+    while ((opt = getopt(argc, argv, "+f:g:m:N:n:op:q:st:w")) != -1) {
+        switch (opt) {
+        case 'f':
+            g_procs = atoi(optarg);
+            if (g_procs < 1) {
+                errx(1, "invalid process count: %s", optarg);
+            }
+            break;
+        case 'g':
+            green_tasks = atoi(optarg);
+            if (green_tasks < 1) {
+                errx(1, "invalid task count: %s", optarg);
+            }
+            g_green = 1;
+            break;
+        case 'm':
+            g_max_matches = atol(optarg);
+            if (g_max_matches < 1) {
+                errx(1, "invalid match count: %s", optarg);
+            }
+            break;
+        case 'N':
+            attr.max_workers = atoi(optarg);
+            break;
+        case 'n':
+            num_threads = atoi(optarg);
+            if (num_threads < 1) {
+                err(1, "invalid thread count: %s", optarg);
+            }
+            threads_set = 1;
+            break;
+        case 'o':
+            g_ordered = 1;
+            break;
+        case 'p':
+            attr.ncpus = cpu_pin_parse(optarg, &pin_cpus);
+            if (attr.ncpus < 1) {
+                errx(1, "invalid CPU pinning: %s", optarg);
+            }
+            attr.cpus = pin_cpus;
+            break;
+        case 'q':
+            if (job_queue_kind_parse(optarg, &attr.queue.kind) != 0) {
+                errx(1, "unknown queue kind: %s", optarg);
+            }
+            queue_set = 1;
+            break;
+        case 's':
+            print_stats = 1;
+            attr.queue.stats = 1;
+            break;
+        case 't':
+            // Record every job, for trace_sim
+            attr.trace = fopen(optarg, "wb");
+            if (attr.trace == NULL) {
+                err(1, "cannot open %s", optarg);
+            }
+            break;
+        case 'w':
+            attr.work_stealing = 1;
+            break;
+        default:
+            errx(1, "usage: [-f INT] [-g INT] [-m INT] [-N INT] [-n INT] [-o]\n"
+                 "       [-p compact|scatter|CPUS] [-q KIND] [-s] [-t FILE] [-w]\n"
+                 "       STRING paths...");
         }
-        needle = argv[3];
-        paths = &argv[4];
-    } else {
-        // No -n flag: default to 1 thread
-        needle = argv[1];
-        paths = &argv[2];
     }
+    attr.queue.soft_cap = WALK_AHEAD;
+    if (optind >= argc) {
+        errx(1, "usage: [-f INT] [-g INT] [-m INT] [-N INT] [-n INT] [-o]\n"
+             "       [-p compact|scatter|CPUS] [-q KIND] [-s] [-t FILE] [-w]\n"
+             "       STRING paths...");
+    }
+    // Worker processes are single-threaded, and share no state but the
+    // queue and the output lock
+    if (g_procs > 0) {
+        if (threads_set || g_green || g_max_matches > 0 || g_ordered || print_stats ||
+            attr.max_workers > 0 || attr.ncpus > 0 || attr.work_stealing ||
+            queue_set || attr.trace != NULL) {
+            errx(1, "-f cannot be combined with other options");
+        }
+        return grep_procs(argv[optind], &argv[optind + 1]);
+    }
+    // Green threads have neither workers to add, pin or trace nor
+    // deques to steal from
+    if (g_green && (attr.max_workers > 0 || attr.ncpus > 0 || attr.work_stealing ||
+                    attr.trace != NULL)) {
+        errx(1, "-g cannot be combined with -N, -p, -t or -w");
+    }
+    char const *needle = argv[optind];
+    char * const *paths = &argv[optind + 1];
 
     g_needle = needle;                      // make the search string accessible to all threads
-    struct job_queue jq;
-    if (job_queue_init(&jq, 64) != 0) {     // initialize job queue with capacity 64
-        err(1, "job_queue_init failed");
-    }
 
-    // Create the worker threads
-    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
-    if (threads == NULL) {
-        err(1, "failed to allocate thread array");
+    // Create the worker threads and the job queue (capacity 64) that
+    // feeds them
+    if (g_ordered &&
+        reorder_init(&g_reorder, ORDER_WINDOW, sizeof(struct outbuf),
+                     emit_output, NULL) != 0) {
+        err(1, "reorder_init() failed");
     }
-    for (int i = 0; i < num_threads; i++) {
-        if (pthread_create(&threads[i], NULL, worker, &jq) != 0) {
-            err(1, "pthread_create() failed");
+    // With -g, 'num_threads' OS threads run 'green_tasks' tasks each
+    struct thread_pool pool;
+    struct green_executor green;
+    if (g_green) {
+        if (green_executor_init(&green, num_threads, green_tasks, 0, &attr.queue) != 0) {
+            err(1, "green_executor_init() failed");
         }
+    } else {
+        if (thread_pool_init(&pool, num_threads, grep_job, &attr) != 0) {
+            err(1, "thread_pool_init() failed");
+        }
+        free(pin_cpus);
+        g_pool = &pool;
     }
 
     // Traverse the given file/directory paths and enqueue each file found
@@ -110,39 +656,90 @@ int main(int argc, char * const *argv) {
     FTS *ftsp = fts_open(paths, fts_flags, NULL);
     if (ftsp == NULL) {
         // If the directory traversal cannot be started, clean up and exit
-        job_queue_destroy(&jq);
+        if (g_green) {
+            green_executor_shutdown(&green);
+        } else {
+            thread_pool_shutdown(&pool);
+        }
         err(1, "fts_open() failed");
     }
     FTSENT *entry;
-    while ((entry = fts_read(ftsp)) != NULL) {
-        if (entry->fts_info == FTS_F) {  // regular file
-            // Duplicate the file path and push it onto the job queue
-            char *path_copy = strdup(entry->fts_path);
-            if (path_copy == NULL) {
+    struct file_job batch[PUSH_BATCH];
+    long long sizes[PUSH_BATCH];
+    int batched = 0;
+    for (;;) {
+        // Once enough matches are found, stop walking
+        entry = stopped() ? NULL : fts_read(ftsp);
+        if (entry != NULL && entry->fts_info == FTS_F) {  // regular file
+            // Copy the file path into the current batch
+            if (path_job_set(&batch[batched].path, entry->fts_path) != 0) {
                 err(1, "out of memory duplicating path");
             }
-            if (job_queue_push(&jq, path_copy) != 0) {
-                // If the queue is destroyed or an error occurs, stop processing
-                free(path_copy);
+            if (g_ordered) {
+                batch[batched].ticket = reorder_ticket(&g_reorder);
+            }
+            // With -q priority, the biggest files are searched first
+            sizes[batched++] = entry->fts_statp->st_size;
+        }
+        // Green tasks are spawned one file at a time, each with its own
+        // copy of the job
+        if (g_green && batched > 0) {
+            struct file_job *gj = malloc(sizeof(struct file_job));
+            if (gj == NULL) {
+                err(1, "out of memory spawning a task");
+            }
+            *gj = batch[0];
+            batched = 0;
+            if (green_spawn(&green, grep_task, gj) != 0) {
+                finish_job(gj, NULL);
+                free(gj);
                 fts_close(ftsp);
-                job_queue_destroy(&jq);
-                err(1, "job_queue_push failed");
+                green_executor_shutdown(&green);
+                err(1, "spawning tasks failed");
             }
         }
         // (Ignore other cases: directories are handled by fts, symbolic links, etc., are skipped)
+
+        // Hand over the batch when it is full, or at the end of the walk
+        if (batched == PUSH_BATCH || (entry == NULL && batched > 0)) {
+            int pushed = thread_pool_submit_many(&pool, batch, sizes, batched);
+            if (pushed != batched) {
+                // If the queue is destroyed or an error occurs, stop processing
+                for (int i = pushed; i < batched; i++) {
+                    finish_job(&batch[i], NULL);
+                }
+                if (stopped()) {
+                    break;
+                }
+                fts_close(ftsp);
+                thread_pool_shutdown(&pool);
+                err(1, "submitting jobs failed");
+            }
+            batched = 0;
+        }
+        if (entry == NULL) {
+            break;
+        }
     }
     fts_close(ftsp);
 
-    // No more files to enqueue. Destroy the queue to signal workers no more jobs will be added.
-    job_queue_destroy(&jq);
-    // At this point, the queue is empty and marked destroyed; waiting threads will break out.
-
-    // Join all worker threads to ensure they have finished processing.
-    for (int i = 0; i < num_threads; i++) {
-        if (pthread_join(threads[i], NULL) != 0) {
-            err(1, "pthread_join() failed");
+    // No more files to enqueue.  Let the workers drain the queue, then
+    // join them to ensure they have finished processing.
+    if (g_green) {
+        if (green_executor_shutdown(&green) != 0) {
+            err(1, "green_executor_shutdown() failed");
         }
+    } else if (thread_pool_shutdown(&pool) != 0) {
+        err(1, "thread_pool_shutdown() failed");
+    }
+    if (attr.trace != NULL && fclose(attr.trace) != 0) {
+        err(1, "writing the trace failed");
+    }
+    if (g_ordered) {
+        reorder_destroy(&g_reorder);
+    }
+    if (print_stats) {
+        print_queue_stats(g_green ? NULL : &pool, &green.queue);
     }
-    free(threads);
     return 0;
 }
@@ -12,26 +12,52 @@
 #include <fts.h>
 #include <pthread.h>
 #include <err.h>
-
-#include "job_queue.h"
+#include <unistd.h>
+
+#include "thread_pool.h"
+#include "path_job.h"
+#include "task_graph.h"
+#include "future.h"
+#include "parallel.h"
+#include "topology.h"
 #include "histogram.h" 
 
 // ---------- Global shared state ----------
 
+// Only the main thread touches these, as results come back through
+// futures; with -d, tasks add to g_hist atomically
 static int    g_hist[8] = {0};          // global bit counts (bit 0..7)
 static size_t g_total_bytes = 0;        // total bytes processed across all files
 static size_t g_last_ui_bytes = 0;      // last byte count printed to the UI
 
-// Protect shared histogram and counters
-static pthread_mutex_t g_hist_mutex   = PTHREAD_MUTEX_INITIALIZER;
 // Serialize all terminal output (warnings + histogram UI)
 pthread_mutex_t         stdout_mutex  = PTHREAD_MUTEX_INITIALIZER;
 
 // UI cadence: print after roughly this many new bytes
 static const size_t PRINT_STEP = 100000;
 
+// Paths move through the job queue in batches to amortise the queue
+// lock over many small files
+#define PUSH_BATCH 32
+#define POP_BATCH  4
+
+// The walker keeps up to this many files in flight, each with a
+// future for its result.  It must be larger than PUSH_BATCH, so that
+// the oldest file has always been submitted by the time its slot is
+// needed again.
+#define RESULT_WINDOW 1024
+
+// With -q segmented the walker may run this many paths ahead of the
+// workers, rather than stopping whenever they fall behind
+#define WALK_AHEAD (64 * 1024)
+
+// Files of at least this size are histogrammed by all workers
+// together, in blocks of PARALLEL_BLOCK bytes, rather than by one
+#define PARALLEL_FILE  (16 << 20)
+#define PARALLEL_BLOCK (1 << 20)
+
 // Convenience: safe UI print of the current snapshot
-static void ui_print_locked(void) {
+static void ui_print(void) {
     pthread_mutex_lock(&stdout_mutex);
     print_histogram(g_hist);    // prints 8 bars + footer
     fflush(stdout);
@@ -39,152 +65,374 @@ static void ui_print_locked(void) {
     pthread_mutex_unlock(&stdout_mutex);
 }
 
-// ---------- Worker thread ----------
-
-static void *worker_fn(void *arg) {
-    struct job_queue *jq = (struct job_queue *)arg;
+// ---------- Workers ----------
 
-    void *data;
-    while (job_queue_pop(jq, &data) == 0) {
-        char *filepath = (char *)data;
-
-        FILE *f = fopen(filepath, "rb");
-        if (!f) {
-            pthread_mutex_lock(&stdout_mutex);
-            warn("failed to open %s", filepath);
-            pthread_mutex_unlock(&stdout_mutex);
-            free(filepath);
-            continue;
+// Count the bits of 'n' bytes into 'totals'.
+static void count_bits(unsigned char const *buf, size_t n, long long totals[8]) {
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char b = buf[i];
+        // For each bit position, add 1 if set
+        for (int bit = 0; bit < 8; ++bit) {
+            totals[bit] += (b >> bit) & 1u;
         }
+    }
+}
 
-        // Local accumulators to reduce contention
-        int    local_hist[8] = {0};
-        size_t local_bytes_since_merge = 0;
-
-        unsigned char buf[8192];
-        size_t n;
-        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
-            // Count bits for this block
-            for (size_t i = 0; i < n; ++i) {
-                unsigned char b = buf[i];
-                // For each bit position, add 1 if set
-                for (int bit = 0; bit < 8; ++bit) {
-                    local_hist[bit] += (b >> bit) & 1u;
-                }
-            }
-            local_bytes_since_merge += n;
-
-            // Merge occasionally so UI stays responsive
-            if (local_bytes_since_merge >= 32768) {
-                pthread_mutex_lock(&g_hist_mutex);
-                for (int bit = 0; bit < 8; ++bit) {
-                    g_hist[bit] += local_hist[bit];
-                    local_hist[bit] = 0;
-                }
-                g_total_bytes += local_bytes_since_merge;
-                local_bytes_since_merge = 0;
-
-                if (g_total_bytes - g_last_ui_bytes >= PRINT_STEP) {
-                    g_last_ui_bytes = g_total_bytes;
-                    // Print a consistent snapshot
-                    ui_print_locked();
-                }
-                pthread_mutex_unlock(&g_hist_mutex);
-            }
+// One block range of a big file, for parallel_reduce().  'acc' holds
+// the eight bit totals and then the number of bytes actually read.
+static void hist_blocks(void *arg, long begin, long end, void *acc) {
+    long long *totals = acc;
+    int fd = *(int *)arg;
+    unsigned char buf[8192];
+    off_t pos = (off_t)begin * PARALLEL_BLOCK;
+    off_t stop = (off_t)end * PARALLEL_BLOCK;
+    while (pos < stop) {
+        size_t want = stop - pos < (off_t)sizeof(buf) ? (size_t)(stop - pos) : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, pos);
+        if (n <= 0) {
+            break;      // the file shrank, or a read error
         }
-        fclose(f);
+        count_bits(buf, n, totals);
+        totals[8] += n;
+        pos += n;
+    }
+}
 
-        // Final merge for leftovers
-        pthread_mutex_lock(&g_hist_mutex);
-        for (int bit = 0; bit < 8; ++bit) {
-            g_hist[bit] += local_hist[bit];
-        }
-        g_total_bytes += local_bytes_since_merge;
+static void hist_combine(void *arg, void *acc, void const *other) {
+    (void)arg;
+    long long *totals = acc;
+    long long const *more = other;
+    for (int i = 0; i < 9; ++i) {
+        totals[i] += more[i];
+    }
+}
 
-        if (g_total_bytes - g_last_ui_bytes >= PRINT_STEP) {
-            g_last_ui_bytes = g_total_bytes;
-            ui_print_locked();
-        }
-        pthread_mutex_unlock(&g_hist_mutex);
+// Count the bits of one file into 'totals'.  Returns the number of
+// bytes read.  A big file is split over the workers of 'pool', unless
+// it is NULL.
+static size_t hist_file(char const *filepath, long long totals[8], struct thread_pool *pool) {
+    FILE *f = fopen(filepath, "rb");
+    if (!f) {
+        pthread_mutex_lock(&stdout_mutex);
+        warn("failed to open %s", filepath);
+        pthread_mutex_unlock(&stdout_mutex);
+        return 0;
+    }
 
-        free(filepath);
+    struct stat st;
+    if (pool && fstat(fileno(f), &st) == 0 && st.st_size >= PARALLEL_FILE) {
+        int fd = fileno(f);
+        long nblocks = (st.st_size + PARALLEL_BLOCK - 1) / PARALLEL_BLOCK;
+        long long acc[9] = { 0 };
+        if (parallel_reduce(pool, 0, nblocks, 0, acc, sizeof(acc),
+                            hist_blocks, hist_combine, &fd) == 0) {
+            fclose(f);
+            for (int bit = 0; bit < 8; ++bit) {
+                totals[bit] += acc[bit];
+            }
+            return acc[8];
+        }
     }
 
-    return NULL;
+    unsigned char buf[8192];
+    size_t n;
+    size_t bytes = 0;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        count_bits(buf, n, totals);
+        bytes += n;
+    }
+    fclose(f);
+    return bytes;
 }
 
-// ---------- Main ----------
+// A file in flight, and the result that comes back with its future
+struct file_result {
+    struct future   future;
+    struct path_job path;
+    long long       hist[8];
+    size_t          bytes;
+};
+
+static void hist_job(struct thread_pool_worker *worker, void *arg) {
+    struct file_result *r = arg;
+    r->bytes = hist_file(path_job_path(&r->path), r->hist, worker->pool);
+    path_job_free(&r->path);
+}
 
-int main(int argc, char * const *argv) {
-    if (argc < 2) {
-        err(1, "usage: [-n N] paths...");
+// Wait for a file's result and add it to the histogram.
+static void collect(struct file_result *r) {
+    future_wait(&r->future);
+    for (int bit = 0; bit < 8; ++bit) {
+        g_hist[bit] += r->hist[bit];
     }
+    g_total_bytes += r->bytes;
+    if (g_total_bytes - g_last_ui_bytes >= PRINT_STEP) {
+        g_last_ui_bytes = g_total_bytes;
+        ui_print();
+    }
+}
 
-    int num_threads = 1;
-    char * const *paths = &argv[1];
-
-    if (argc > 3 && strcmp(argv[1], "-n") == 0) {
-        num_threads = atoi(argv[2]);
-        if (num_threads < 1) {
-            err(1, "invalid thread count: %s", argv[2]);
+// ---------- Per-directory totals (-d) ----------
+//
+// With -d, every file and directory becomes a task in a task graph.
+// A directory's task depends on the tasks for everything in it, so it
+// runs, and prints the directory's total, as soon as its own subtree
+// is done, while the rest of the tree is still being worked on.
+
+struct node {
+    char        *path;
+    struct node *parent;    // NULL for the paths given on the command line
+    long long    hist[8];   // the subtree's counts, added up by the children
+};
+
+// Add a finished node's counts to its directory, and free it.  The
+// directory's task cannot run before this one has finished.
+static void node_done(struct node *node) {
+    if (node->parent) {
+        for (int bit = 0; bit < 8; ++bit) {
+            __atomic_add_fetch(&node->parent->hist[bit], node->hist[bit], __ATOMIC_RELAXED);
         }
-        paths = &argv[3];
     }
+    free(node->path);
+    free(node);
+}
 
-    // Init job queue
-    struct job_queue jq;
-    if (job_queue_init(&jq, 64) != 0) {
-        err(1, "job_queue_init failed");
+static void file_task(struct thread_pool_worker *worker, void *arg) {
+    (void)worker;
+    struct node *node = arg;
+    // A task graph's pool cannot run parallel_reduce()'s helpers
+    hist_file(node->path, node->hist, NULL);
+    for (int bit = 0; bit < 8; ++bit) {
+        __atomic_add_fetch(&g_hist[bit], (int)node->hist[bit], __ATOMIC_RELAXED);
     }
+    node_done(node);
+}
+
+static void dir_task(struct thread_pool_worker *worker, void *arg) {
+    (void)worker;
+    struct node *node = arg;
+    long long bits = 0;
+    for (int bit = 0; bit < 8; ++bit) {
+        bits += node->hist[bit];
+    }
+    pthread_mutex_lock(&stdout_mutex);
+    printf("%lld bits in %s\n", bits, node->path);
+    pthread_mutex_unlock(&stdout_mutex);
+    node_done(node);
+}
 
-    // Start workers
-    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
-    if (!threads) {
-        err(1, "failed to allocate thread array");
+// Create the task for an fts entry.  The task of its directory is in
+// the directory entry's fts_pointer.
+static struct task *entry_task(struct task_graph *graph, FTSENT *ent, task_fn fn) {
+    struct task *parent = NULL;
+    if (ent->fts_level > FTS_ROOTLEVEL) {
+        parent = ent->fts_parent->fts_pointer;
+    }
+    struct node *node = calloc(1, sizeof(struct node));
+    if (!node || !(node->path = strdup(ent->fts_path))) {
+        err(1, "out of memory");
+    }
+    node->parent = parent ? parent->arg : NULL;
+    struct task *task = task_create(graph, fn, node);
+    if (!task || (parent && task_depends(parent, task) != 0)) {
+        err(1, "out of memory");
     }
-    for (int i = 0; i < num_threads; ++i) {
-        if (pthread_create(&threads[i], NULL, worker_fn, &jq) != 0) {
-            err(1, "pthread_create failed");
+    return task;
+}
+
+// Walk the tree, submitting each file's task at once and each
+// directory's task once everything in it has been seen.
+static void walk_by_dir(struct task_graph *graph, FTS *ftsp) {
+    FTSENT *ent;
+    while ((ent = fts_read(ftsp)) != NULL) {
+        struct task *task = NULL;
+        switch (ent->fts_info) {
+        case FTS_D:
+            ent->fts_pointer = entry_task(graph, ent, dir_task);
+            break;
+        case FTS_F:
+            task = entry_task(graph, ent, file_task);
+            break;
+        case FTS_DP:
+        case FTS_DNR:
+            task = ent->fts_pointer;
+            break;
+        }
+        if (task) {
+            if (task_submit(task) != 0) {
+                err(1, "submitting task failed");
+            }
+            task_release(task);
         }
     }
+}
 
-    // Walk the file tree and enqueue regular files
-    int fts_flags = FTS_LOGICAL | FTS_NOCHDIR;
-    FTS *ftsp = fts_open(paths, fts_flags, NULL);
-    if (!ftsp) {
-        job_queue_destroy(&jq);
-        err(1, "fts_open failed");
+// Report on the job queue to stderr, so that a run with -s shows
+// whether the workers starved (slept for elements), the walker was
+// held up (slept for room), or the queue lock itself was contended.
+static void print_queue_stats(struct thread_pool *pool) {
+    struct job_queue_stats stats;
+    if (thread_pool_stats(pool, &stats) != 0) {
+        warnx("no job queue statistics with work stealing");
+        return;
     }
+    job_queue_stats_print(stderr, &stats);
+    if (pool->attr.max_workers > pool->nworkers) {
+        fprintf(stderr, "workers: %d at most\n", pool->peak);
+    }
+}
 
+// Walk the tree and submit every regular file, in batches, collecting
+// results in order as the window of files in flight fills up.
+static void walk_files(struct thread_pool *pool, FTS *ftsp) {
+    struct file_result *results = calloc(RESULT_WINDOW, sizeof(struct file_result));
+    if (!results) {
+        err(1, "out of memory");
+    }
+    unsigned long submitted = 0;    // files handed to the pool
+    unsigned long collected = 0;    // results added to g_hist
     FTSENT *ent;
-    while ((ent = fts_read(ftsp)) != NULL) {
-        if (ent->fts_info == FTS_F) {
-            char *path_copy = strdup(ent->fts_path);
-            if (!path_copy) {
+    void *batch[PUSH_BATCH];
+    long long sizes[PUSH_BATCH];
+    int batched = 0;
+    do {
+        ent = fts_read(ftsp);
+        if (ent && ent->fts_info == FTS_F) {
+            unsigned long next = submitted + batched;
+            if (next - collected == RESULT_WINDOW) {
+                collect(&results[collected++ % RESULT_WINDOW]);
+            }
+            struct file_result *r = &results[next % RESULT_WINDOW];
+            if (path_job_set(&r->path, ent->fts_path) != 0) {
                 fts_close(ftsp);
-                job_queue_destroy(&jq);
+                thread_pool_shutdown(pool);
                 err(1, "out of memory duplicating path");
             }
-            if (job_queue_push(&jq, path_copy) != 0) {
-                free(path_copy);
+            memset(r->hist, 0, sizeof(r->hist));
+            future_init(&r->future, hist_job, r);
+            batch[batched] = &r->future;
+            // Biggest files first with -q priority
+            sizes[batched++] = ent->fts_statp->st_size;
+        }
+        // Flush when the batch is full and once more at the end
+        if (batched == PUSH_BATCH || (!ent && batched > 0)) {
+            if (thread_pool_submit_many(pool, batch, sizes, batched) != batched) {
                 fts_close(ftsp);
-                job_queue_destroy(&jq);
-                err(1, "job_queue_push failed");
+                thread_pool_shutdown(pool);
+                err(1, "submitting jobs failed");
             }
+            submitted += batched;
+            batched = 0;
         }
+    } while (ent);
+    while (collected < submitted) {
+        collect(&results[collected++ % RESULT_WINDOW]);
     }
-    fts_close(ftsp);
+    free(results);
+}
 
-    // No more jobs; signal workers to finish when queue drains
-    job_queue_destroy(&jq);
+// ---------- Main ----------
 
-    // Wait for all workers
-    for (int i = 0; i < num_threads; ++i) {
-        if (pthread_join(threads[i], NULL) != 0) {
-            err(1, "pthread_join failed");
+int main(int argc, char * const *argv) {
+    int num_threads = 1;
+    int print_stats = 0;
+
+    struct thread_pool_attr attr;
+    thread_pool_attr_init(&attr);
+    attr.batch = POP_BATCH;
+    int by_dir = 0;
+    int *pin_cpus = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "+dN:n:p:q:st:w")) != -1) {
+        switch (opt) {
+        case 'd':
+            by_dir = 1;
+            break;
+        case 'N':
+            attr.max_workers = atoi(optarg);
+            break;
+        case 'n':
+            num_threads = atoi(optarg);
+            if (num_threads < 1) {
+                err(1, "invalid thread count: %s", optarg);
+            }
+            break;
+        case 'p':
+            attr.ncpus = cpu_pin_parse(optarg, &pin_cpus);
+            if (attr.ncpus < 1) {
+                errx(1, "invalid CPU pinning: %s", optarg);
+            }
+            attr.cpus = pin_cpus;
+            break;
+        case 'q':
+            if (job_queue_kind_parse(optarg, &attr.queue.kind) != 0) {
+                errx(1, "unknown queue kind: %s", optarg);
+            }
+            break;
+        case 's':
+            print_stats = 1;
+            attr.queue.stats = 1;
+            break;
+        case 't':
+            // Record every job, for trace_sim
+            attr.trace = fopen(optarg, "wb");
+            if (attr.trace == NULL) {
+                err(1, "cannot open %s", optarg);
+            }
+            break;
+        case 'w':
+            attr.work_stealing = 1;
+            break;
+        default:
+            errx(1, "usage: [-d] [-N N] [-n N] [-p compact|scatter|CPUS] [-q KIND] [-s]\n"
+                 "       [-t FILE] [-w] paths...");
+        }
+    }
+    attr.queue.soft_cap = WALK_AHEAD;
+    if (optind >= argc) {
+        errx(1, "usage: [-d] [-N N] [-n N] [-p compact|scatter|CPUS] [-q KIND] [-s]\n"
+                 "       [-t FILE] [-w] paths...");
+    }
+    char * const *paths = &argv[optind];
+
+    // Start workers, fed by a job queue (or the work-stealing
+    // scheduler).  The jobs are futures, or with -d tasks of a task
+    // graph.
+    struct thread_pool pool;
+    if (thread_pool_init(&pool, num_threads, by_dir ? task_graph_run : future_run,
+                         &attr) != 0) {
+        err(1, "thread_pool_init failed");
+    }
+    free(pin_cpus);
+
+    // Walk the file tree and enqueue regular files (or, with -d, tasks)
+    int fts_flags = FTS_LOGICAL | FTS_NOCHDIR;
+    FTS *ftsp = fts_open(paths, fts_flags, NULL);
+    if (!ftsp) {
+        thread_pool_shutdown(&pool);
+        err(1, "fts_open failed");
+    }
+
+    if (by_dir) {
+        struct task_graph graph;
+        if (task_graph_init(&graph, &pool) != 0) {
+            errx(1, "task_graph_init failed");
         }
+        walk_by_dir(&graph, ftsp);
+        task_graph_destroy(&graph);
+    } else {
+        walk_files(&pool, ftsp);
+    }
+    fts_close(ftsp);
+
+    // No more jobs; let workers drain the queue and wait for them
+    if (thread_pool_shutdown(&pool) != 0) {
+        err(1, "thread_pool_shutdown failed");
+    }
+    if (attr.trace != NULL && fclose(attr.trace) != 0) {
+        err(1, "writing the trace failed");
     }
-    free(threads);
 
     // Final print leaves the result visible on screen
     pthread_mutex_lock(&stdout_mutex);
@@ -193,5 +441,9 @@ int main(int argc, char * const *argv) {
     // Do not call move_lines(9) here
     pthread_mutex_unlock(&stdout_mutex);
 
+    if (print_stats) {
+        print_queue_stats(&pool);
+    }
+
     return 0;
 }
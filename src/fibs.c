@@ -21,7 +21,11 @@
 // very handy.
 #include <err.h>
 
-#include "job_queue.h"
+#include <unistd.h>
+
+#include "thread_pool.h"
+#include "reorder.h"
+#include "topology.h"
 
 // Whenever we print to the screen, we will first lock this mutex.
 // This ensures that multiple threads do not try to print
@@ -38,86 +42,171 @@ int fib (int n) {
   }
 }
 
-// This function converts a line to an integer, computes the
-// corresponding Fibonacci number, then prints the result to the
-// screen.
-void fib_line(const char *line) {
-  int n = atoi(line);
-  int fibn = fib(n);
+void print_fib(int n, int fibn) {
   assert(pthread_mutex_lock(&stdout_mutex) == 0);
   printf("fib(%d) = %d\n", n, fibn);
   assert(pthread_mutex_unlock(&stdout_mutex) == 0);
 }
 
-// Each thread will run this function.  The thread argument is a
-// pointer to a job queue.
-void* worker(void *arg) {
-  struct job_queue *jq = arg;
-
-  while (1) {
-    char *line;
-    if (job_queue_pop(jq, (void**)&line) == 0) {
-      fib_line(line);
-      free(line);
-    } else {
-      // If job_queue_pop() returned non-zero, that means the queue is
-      // being killed (or some other error occured).  In any case,
-      // that means it's time for this thread to die.
-      break;
-    }
+// This function computes the Fibonacci number for an integer read
+// from a line, then prints the result to the screen.
+void fib_line(int n) {
+  print_fib(n, fib(n));
+}
+
+// With -o, results are printed in input order, through a reorder
+// buffer that holds up to this many of them.
+#define ORDER_WINDOW 1024
+
+static int g_ordered = 0;
+static struct reorder g_reorder;
+
+// A job is the integer from a line, stored in the job queue itself
+// (see attr.job_size below) so that there is nothing to allocate or
+// free per line, and with -o its place in the output.
+struct fib_job {
+  int           n;
+  unsigned long ticket;
+};
+
+struct fib_result {
+  int n;
+  int fibn;
+  int computed;   // 0 for a line whose job could not be submitted
+};
+
+static void emit_fib(void *result, void *arg) {
+  (void)arg;
+  struct fib_result *r = result;
+  if (r->computed) {
+    print_fib(r->n, r->fibn);
+  }
+}
+
+// Each worker thread runs this for every line it is handed.
+static void fib_job(struct thread_pool_worker *worker, void *job) {
+  (void)worker;
+  struct fib_job *fj = job;
+  if (g_ordered) {
+    struct fib_result r = { fj->n, fib(fj->n), 1 };
+    reorder_done(&g_reorder, fj->ticket, &r);
+  } else {
+    fib_line(fj->n);
   }
+}
 
-  return NULL;
+// Print the statistics of the job queue to stderr.  They show, for
+// instance, whether the workers were waiting for input (time slept for
+// elements) or the queue lock was a bottleneck.
+static void print_queue_stats(struct thread_pool *pool) {
+  struct job_queue_stats stats;
+  if (thread_pool_stats(pool, &stats) != 0) {
+    warnx("no job queue statistics with work stealing");
+    return;
+  }
+  job_queue_stats_print(stderr, &stats);
+  if (pool->attr.max_workers > pool->nworkers) {
+    fprintf(stderr, "workers: %d at most\n", pool->peak);
+  }
 }
 
 int main(int argc, char * const *argv) {
   int num_threads = 1;
-
-  if (argc == 3 && strcmp(argv[1], "-n") == 0) {
-    // Since atoi() simply returns zero on syntax errors, we cannot
-    // distinguish between the user entering a zero, or some
-    // non-numeric garbage.  In fact, we cannot even tell whether the
-    // given option is suffixed by garbage, i.e. '123foo' returns
-    // '123'.  A more robust solution would use strtol(), but its
-    // interface is more complicated, so here we are.
-    num_threads = atoi(argv[2]);
-
-    if (num_threads < 1) {
-      err(1, "invalid thread count: %s", argv[2]);
+  int print_stats = 0;
+  struct thread_pool_attr attr;
+  thread_pool_attr_init(&attr);
+  attr.job_size = sizeof(struct fib_job);
+  int *pin_cpus = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "N:n:op:sw")) != -1) {
+    switch (opt) {
+    case 'N':
+      // Let the pool grow to this many workers while jobs back up
+      // (see thread_pool_attr.max_workers).
+      attr.max_workers = atoi(optarg);
+      break;
+    case 'n':
+      // Since atoi() simply returns zero on syntax errors, we cannot
+      // distinguish between the user entering a zero, or some
+      // non-numeric garbage.  In fact, we cannot even tell whether the
+      // given option is suffixed by garbage, i.e. '123foo' returns
+      // '123'.  A more robust solution would use strtol(), but its
+      // interface is more complicated, so here we are.
+      num_threads = atoi(optarg);
+
+      if (num_threads < 1) {
+        err(1, "invalid thread count: %s", optarg);
+      }
+      break;
+    case 'o':
+      // Print results in input order (see fib_job()).
+      g_ordered = 1;
+      break;
+    case 'p':
+      // Pin the workers: "compact", "scatter" or a CPU list (see
+      // cpu_pin_parse()).
+      attr.ncpus = cpu_pin_parse(optarg, &pin_cpus);
+      if (attr.ncpus < 1) {
+        errx(1, "invalid CPU pinning: %s", optarg);
+      }
+      attr.cpus = pin_cpus;
+      break;
+    case 's':
+      // Report on the job queue at exit (see print_stats below).
+      print_stats = 1;
+      attr.queue.stats = 1;
+      break;
+    case 'w':
+      attr.work_stealing = 1;
+      break;
+    default:
+      errx(1, "usage: [-N INT] [-n INT] [-o] [-p compact|scatter|CPUS] [-s] [-w]");
     }
   }
 
-  // Create job queue.
-  struct job_queue jq;
-  job_queue_init(&jq, 64);
-
-  // Start up the worker threads.
-  pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
-  for (int i = 0; i < num_threads; i++) {
-    if (pthread_create(&threads[i], NULL, &worker, &jq) != 0) {
-      err(1, "pthread_create() failed");
-    }
+  if (g_ordered &&
+      reorder_init(&g_reorder, ORDER_WINDOW, sizeof(struct fib_result),
+                   emit_fib, NULL) != 0) {
+    err(1, "reorder_init() failed");
   }
 
+  // Start up the worker threads, fed by a job queue or (with -w) the
+  // work-stealing scheduler.
+  struct thread_pool pool;
+  if (thread_pool_init(&pool, num_threads, fib_job, &attr) != 0) {
+    err(1, "thread_pool_init() failed");
+  }
+  free(pin_cpus);
 
   // Now read lines from stdin until EOF.
   char *line = NULL;
   ssize_t line_len;
   size_t buf_len = 0;
   while ((line_len = getline(&line, &buf_len, stdin)) != -1) {
-    job_queue_push(&jq, (void*)strdup(line));
+    struct fib_job job = { atoi(line), 0 };
+    if (g_ordered) {
+      job.ticket = reorder_ticket(&g_reorder);
+    }
+    if (thread_pool_submit(&pool, &job) != 0 && g_ordered) {
+      // Fill the gap, or the results after it would never come out
+      struct fib_result r = { job.n, 0, 0 };
+      reorder_done(&g_reorder, job.ticket, &r);
+    }
   }
   free(line);
 
-  // Destroy the queue.
-  job_queue_destroy(&jq);
+  // Let the workers finish the remaining jobs, then wait for all
+  // threads to finish.  This is important, as some may still be
+  // working on their job.
+  if (thread_pool_shutdown(&pool) != 0) {
+    err(1, "thread_pool_shutdown() failed");
+  }
+  if (g_ordered) {
+    reorder_destroy(&g_reorder);
+  }
 
-  // Wait for all threads to finish.  This is important, at some may
-  // still be working on their job.
-  for (int i = 0; i < num_threads; i++) {
-    if (pthread_join(threads[i], NULL) != 0) {
-      err(1, "pthread_join() failed");
-    }
+  if (print_stats) {
+    print_queue_stats(&pool);
   }
-  free(threads);
 }
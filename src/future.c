@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "future.h"
+
+// 'state' goes from PENDING to DONE, passing through WAITED if a
+// waiter has gone to sleep on it, so that finishing a job only costs a
+// system call when somebody is actually waiting.  The waker may still
+// call FUTEX_WAKE on the word after the waiter has returned and reused
+// the future; that only causes a spurious wakeup, which every wait
+// loop tolerates.
+#define PENDING 0
+#define WAITED  1
+#define DONE    2
+// A future_spawn() job, which future_run() frees instead
+#define SPAWNED 3
+
+// See future_worker()
+static __thread struct thread_pool_worker *current_worker;
+
+void future_init(struct future *future, future_fn fn, void *arg) {
+  future->fn = fn;
+  future->arg = arg;
+  future->state = PENDING;
+}
+
+int future_submit(struct thread_pool *pool, struct future *future,
+                  future_fn fn, void *arg) {
+  if (pool->attr.job_size != 0) {
+    return -1;
+  }
+  future_init(future, fn, arg);
+  return thread_pool_submit(pool, future);
+}
+
+int future_spawn(struct thread_pool *pool, future_fn fn, void *arg) {
+  if (pool->attr.job_size != 0) {
+    return -1;
+  }
+  struct future *future = malloc(sizeof(struct future));
+  if (future == NULL) {
+    return -1;
+  }
+  future->fn = fn;
+  future->arg = arg;
+  future->state = SPAWNED;
+  if (current_worker != NULL && current_worker->pool == pool) {
+    thread_pool_spawn(current_worker, future);
+    return 0;
+  }
+  if (thread_pool_submit(pool, future) != 0) {
+    free(future);
+    return -1;
+  }
+  return 0;
+}
+
+void future_run(struct thread_pool_worker *worker, void *job) {
+  struct future *future = job;
+  // A job may run inline inside another (see thread_pool_spawn())
+  struct thread_pool_worker *outer = current_worker;
+  current_worker = worker;
+  int spawned = __atomic_load_n(&future->state, __ATOMIC_RELAXED) == SPAWNED;
+  future->fn(worker, future->arg);
+  current_worker = outer;
+  if (spawned) {
+    free(future);
+  } else if (__atomic_exchange_n(&future->state, DONE, __ATOMIC_RELEASE) == WAITED) {
+    syscall(SYS_futex, &future->state, FUTEX_WAKE | FUTEX_PRIVATE_FLAG,
+            INT_MAX, NULL, NULL, 0);
+  }
+}
+
+struct thread_pool_worker *future_worker(void) {
+  return current_worker;
+}
+
+int future_poll(struct future *future) {
+  return __atomic_load_n(&future->state, __ATOMIC_ACQUIRE) == DONE;
+}
+
+void future_wait(struct future *future) {
+  unsigned state = __atomic_load_n(&future->state, __ATOMIC_ACQUIRE);
+  while (state != DONE) {
+    if (state == PENDING &&
+        !__atomic_compare_exchange_n(&future->state, &state, WAITED, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+      continue;  // 'state' now holds the new value
+    }
+    syscall(SYS_futex, &future->state, FUTEX_WAIT | FUTEX_PRIVATE_FLAG,
+            WAITED, NULL, NULL, 0);
+    state = __atomic_load_n(&future->state, __ATOMIC_ACQUIRE);
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef FUTURE_H
+#define FUTURE_H
+
+// Completion handles for jobs run by a thread_pool.
+//
+// The submitter owns a struct future (typically inside a struct of
+// its own that also has room for the job's input and result), submits
+// it with a function to run, and later polls or waits for it.  Once
+// future_wait() returns, everything the job wrote is visible to the
+// waiter, so results travel back through memory the two share without
+// any global lock.
+//
+// The pool must be created with future_run() as its 'run' function
+// and without attr.job_size; its jobs are then futures.
+
+#include "thread_pool.h"
+
+typedef void (*future_fn)(struct thread_pool_worker *worker, void *arg);
+
+struct future {
+    future_fn fn;
+    void     *arg;
+    unsigned  state;    // futex word, see future.c
+};
+
+// Set up 'future' to run 'fn' with 'arg', for submitting by hand,
+// for instance in a batch with thread_pool_submit_many().
+void future_init(struct future *future, future_fn fn, void *arg);
+
+// Run 'fn' with 'arg' on the pool, and let 'future' track it.  The
+// future must stay put until future_wait() (or a non-zero
+// future_poll()) says the job is done, after which it may be reused.
+// Blocks while the pool's queue is full.  Returns non-zero on error,
+// including if the pool passes jobs by value, in which case the job
+// does not run.
+int future_submit(struct thread_pool *pool, struct future *future,
+                  future_fn fn, void *arg);
+
+// Run 'fn' with 'arg' on the pool without a future to wait for; the
+// job has to report back by itself.  Called from inside one of the
+// pool's jobs, it never blocks (see thread_pool_spawn()).  Returns
+// non-zero on error, in which case the job does not run.
+int future_spawn(struct thread_pool *pool, future_fn fn, void *arg);
+
+// The 'run' function for the pool.
+void future_run(struct thread_pool_worker *worker, void *job);
+
+// The worker whose job the calling thread is running, or NULL if it is
+// not running a job of a future_run() pool.
+struct thread_pool_worker *future_worker(void);
+
+// Non-zero if the job has finished.
+int future_poll(struct future *future);
+
+// Block until the job has finished.
+void future_wait(struct future *future);
+
+#endif
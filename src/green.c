@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "green.h"
+
+// A task waiting to be started, as queued
+struct green_job {
+  green_fn fn;
+  void    *arg;
+};
+
+// Task states, as seen by the scheduler after switching back to it
+#define TASK_FREE     0   // the slot is unused
+#define TASK_RUNNABLE 1   // yielded, or not yet run
+#define TASK_WAITING  2   // waiting for data (see green_pread())
+#define TASK_DONE     3
+
+struct green_task {
+  ucontext_t          ctx;
+  struct green_sched *sched;
+  struct green_job    job;
+  int                 state;
+  int                 may_block;  // the next read may block the thread
+  char               *stack;      // above a guard page
+};
+
+struct green_sched {
+  struct green_executor *ex;
+  ucontext_t             main;    // the scheduler loop
+  struct green_task     *tasks;   // tasks_per_thread slots
+  struct green_job      *jobs;    // as many, for popping new tasks
+  int                    running; // slots in use
+  int                    next_block; // where to look for a task that may block
+  pthread_t              thread;
+};
+
+// The task running on the calling thread, if any
+static __thread struct green_task *current;
+
+static size_t page_size(void) {
+  return sysconf(_SC_PAGESIZE);
+}
+
+// ---------- Tasks ----------
+
+static void task_entry(void) {
+  struct green_task *task = current;
+  task->job.fn(task->job.arg);
+  task->state = TASK_DONE;
+  // Returning resumes the scheduler through uc_link
+}
+
+// Switch from the current task back to its scheduler.
+static void task_yield(struct green_task *task, int state) {
+  task->state = state;
+  current = NULL;
+  assert(swapcontext(&task->ctx, &task->sched->main) == 0);
+  current = task;
+}
+
+void green_yield(void) {
+  if (current != NULL) {
+    task_yield(current, TASK_RUNNABLE);
+  }
+}
+
+ssize_t green_pread(int fd, void *buf, size_t count, off_t offset) {
+  struct green_task *task = current;
+  if (task == NULL) {
+    return pread(fd, buf, count, offset);
+  }
+  struct iovec iov = { buf, count };
+  int advised = 0;
+  for (;;) {
+    if (task->may_block) {
+      task->may_block = 0;
+      return pread(fd, buf, count, offset);
+    }
+    ssize_t n = preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+    if (n >= 0 || (errno != EAGAIN && errno != EOPNOTSUPP)) {
+      return n;
+    }
+    if (errno == EOPNOTSUPP) {
+      // The file system cannot tell; just read
+      return pread(fd, buf, count, offset);
+    }
+    // Not cached: have the kernel start fetching it, and let the other
+    // tasks run meanwhile
+    if (!advised) {
+      posix_fadvise(fd, offset, count, POSIX_FADV_WILLNEED);
+      advised = 1;
+    }
+    task_yield(task, TASK_WAITING);
+  }
+}
+
+// ---------- Scheduler ----------
+
+// Start 'job' in a free slot.
+static void task_start(struct green_sched *sched, struct green_job const *job) {
+  struct green_task *task = NULL;
+  for (int i = 0; i < sched->ex->tasks_per_thread; i++) {
+    if (sched->tasks[i].state == TASK_FREE) {
+      task = &sched->tasks[i];
+      break;
+    }
+  }
+  assert(task != NULL);
+  task->job = *job;
+  task->state = TASK_RUNNABLE;
+  task->may_block = 0;
+  assert(getcontext(&task->ctx) == 0);
+  task->ctx.uc_stack.ss_sp = task->stack;
+  task->ctx.uc_stack.ss_size = sched->ex->stack_size;
+  task->ctx.uc_link = &sched->main;
+  makecontext(&task->ctx, task_entry, 0);
+  sched->running++;
+}
+
+static void *sched_main(void *arg) {
+  struct green_sched *sched = arg;
+  struct green_executor *ex = sched->ex;
+  int closed = 0;
+  for (;;) {
+    // Fill the free slots, waiting for tasks only if there is nothing
+    // else to do
+    int free_slots = ex->tasks_per_thread - sched->running;
+    if (!closed && free_slots > 0) {
+      int n = sched->running == 0
+        ? job_queue_pop_values(&ex->queue, sched->jobs, free_slots)
+        : job_queue_try_pop_values(&ex->queue, sched->jobs, free_slots);
+      if (n < 0) {
+        closed = 1;
+      }
+      for (int i = 0; i < n; i++) {
+        task_start(sched, &sched->jobs[i]);
+      }
+    }
+    if (sched->running == 0) {
+      if (closed) {
+        break;
+      }
+      continue;
+    }
+
+    // Run every task once, until it yields or finishes
+    int progress = 0;
+    for (int i = 0; i < ex->tasks_per_thread; i++) {
+      struct green_task *task = &sched->tasks[i];
+      if (task->state == TASK_FREE) {
+        continue;
+      }
+      current = task;
+      assert(swapcontext(&sched->main, &task->ctx) == 0);
+      current = NULL;
+      if (task->state == TASK_DONE) {
+        task->state = TASK_FREE;
+        sched->running--;
+        progress = 1;
+      } else if (task->state == TASK_RUNNABLE) {
+        progress = 1;
+      }
+    }
+    if (!progress) {
+      // Everybody waits for data: block in one read, taking turns, while
+      // the readahead of the others goes on
+      for (int i = 0; i < ex->tasks_per_thread; i++) {
+        struct green_task *task = &sched->tasks[(sched->next_block + i) % ex->tasks_per_thread];
+        if (task->state == TASK_WAITING) {
+          task->may_block = 1;
+          sched->next_block = (sched->next_block + i + 1) % ex->tasks_per_thread;
+          break;
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+// ---------- Executor ----------
+
+// Allocate the slots and stacks of a scheduler, each stack with an
+// inaccessible guard page below it to catch overflows.  Returns
+// non-zero on error.
+static int sched_init(struct green_sched *sched, struct green_executor *ex) {
+  sched->ex = ex;
+  sched->running = 0;
+  sched->next_block = 0;
+  sched->tasks = calloc(ex->tasks_per_thread, sizeof(struct green_task));
+  sched->jobs = calloc(ex->tasks_per_thread, sizeof(struct green_job));
+  if (sched->tasks == NULL || sched->jobs == NULL) {
+    return -1;
+  }
+  size_t guard = page_size();
+  for (int i = 0; i < ex->tasks_per_thread; i++) {
+    char *mem = mmap(NULL, guard + ex->stack_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (mem == MAP_FAILED) {
+      return -1;
+    }
+    mprotect(mem, guard, PROT_NONE);
+    sched->tasks[i].sched = sched;
+    sched->tasks[i].state = TASK_FREE;
+    sched->tasks[i].stack = mem + guard;
+  }
+  return 0;
+}
+
+static void sched_fini(struct green_sched *sched) {
+  free(sched->jobs);
+  sched->jobs = NULL;
+  if (sched->tasks == NULL) {
+    return;
+  }
+  size_t guard = page_size();
+  for (int i = 0; i < sched->ex->tasks_per_thread; i++) {
+    if (sched->tasks[i].stack != NULL) {
+      munmap(sched->tasks[i].stack - guard, guard + sched->ex->stack_size);
+    }
+  }
+  free(sched->tasks);
+  sched->tasks = NULL;
+}
+
+int green_executor_init(struct green_executor *ex, int nthreads, int tasks_per_thread,
+                        size_t stack_size, struct job_queue_attr const *attr) {
+  if (nthreads < 1 || tasks_per_thread < 1) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct job_queue_attr qattr;
+  if (attr != NULL) {
+    qattr = *attr;
+  } else {
+    job_queue_attr_init(&qattr);
+  }
+  // Every thread pops
+  if (qattr.kind == JOB_QUEUE_SPSC && nthreads > 1) {
+    errno = EINVAL;
+    return -1;
+  }
+  qattr.elem_size = sizeof(struct green_job);
+  size_t guard = page_size();
+  ex->nthreads = nthreads;
+  ex->tasks_per_thread = tasks_per_thread;
+  ex->stack_size = ((stack_size > 0 ? stack_size : GREEN_STACK_SIZE) + guard - 1) / guard * guard;
+  ex->scheds = calloc(nthreads, sizeof(struct green_sched));
+  if (ex->scheds == NULL) {
+    return -1;
+  }
+  // Enough queued tasks to refill every slot once
+  if (job_queue_init_attr(&ex->queue, nthreads * tasks_per_thread, &qattr) != 0) {
+    free(ex->scheds);
+    return -1;
+  }
+  int started = 0;
+  int failed = 0;
+  for (; started < nthreads; started++) {
+    struct green_sched *sched = &ex->scheds[started];
+    if (sched_init(sched, ex) != 0 ||
+        pthread_create(&sched->thread, NULL, sched_main, sched) != 0) {
+      sched_fini(sched);
+      failed = 1;
+      break;
+    }
+  }
+  if (failed) {
+    // The threads that did start find the queue closed and empty
+    job_queue_destroy(&ex->queue);
+    for (int i = 0; i < started; i++) {
+      pthread_join(ex->scheds[i].thread, NULL);
+      sched_fini(&ex->scheds[i]);
+    }
+    free(ex->scheds);
+    return -1;
+  }
+  return 0;
+}
+
+int green_spawn(struct green_executor *ex, green_fn fn, void *arg) {
+  struct green_job job = { fn, arg };
+  return job_queue_push_value(&ex->queue, &job);
+}
+
+int green_executor_shutdown(struct green_executor *ex) {
+  // Destroying the queue waits for the threads to take every task;
+  // each thread then finishes its own before it exits
+  job_queue_destroy(&ex->queue);
+  int ret = 0;
+  for (int i = 0; i < ex->nthreads; i++) {
+    if (pthread_join(ex->scheds[i].thread, NULL) != 0) {
+      ret = -1;
+    }
+    sched_fini(&ex->scheds[i]);
+  }
+  free(ex->scheds);
+  ex->scheds = NULL;
+  return ret;
+}
@@ -0,0 +1,70 @@
+#ifndef GREEN_H
+#define GREEN_H
+
+// Green threads: many lightweight tasks multiplexed on a few OS
+// threads, for jobs that spend most of their time waiting for reads.
+//
+// In a thread_pool, a job blocked in read() holds on to its worker, so
+// keeping many reads in flight takes as many threads.  Here every job
+// is a task with its own small stack (a ucontext), and each OS thread
+// switches between up to 'tasks_per_thread' of them.  A task that
+// reads with green_pread() does not block on data that is not cached
+// yet: it starts readahead for it and yields, so that the thread runs
+// the other tasks while the kernel fetches the data.  In-flight reads
+// thus scale with the number of tasks rather than of threads.
+//
+// Only green_pread() yields like this; anything else a task does
+// (open(), say, or a lock) blocks its whole thread as usual.  When
+// every task of a thread is waiting for data, the thread blocks in one
+// of their reads, so it never spins.
+//
+// Tasks are handed to the threads through a job_queue, so spawning
+// blocks while all threads are busy and the queue is full.
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "job_queue.h"
+
+typedef void (*green_fn)(void *arg);
+
+struct green_sched;
+
+struct green_executor {
+    struct job_queue    queue;      // of struct green_job, by value
+    int                 nthreads;
+    int                 tasks_per_thread;
+    size_t              stack_size;
+    struct green_sched *scheds;     // one per OS thread
+};
+
+// Default stack size of a task, excluding a guard page.
+#define GREEN_STACK_SIZE (64 * 1024)
+
+// Start 'nthreads' OS threads running up to 'tasks_per_thread' tasks
+// each, with stacks of 'stack_size' bytes (0 for GREEN_STACK_SIZE).
+// 'attr' chooses the queue that feeds them, as for
+// job_queue_init_attr() (NULL for the defaults); JOB_QUEUE_SPSC only
+// works with one thread.  Returns non-zero on error, with errno EINVAL
+// for bad arguments.
+int green_executor_init(struct green_executor *ex, int nthreads, int tasks_per_thread,
+                        size_t stack_size, struct job_queue_attr const *attr);
+
+// Run 'fn' with 'arg' as a new task.  Blocks while the queue of tasks
+// not yet started is full.  Returns non-zero on error, including after
+// green_executor_shutdown().
+int green_spawn(struct green_executor *ex, green_fn fn, void *arg);
+
+// Let the thread's other tasks run.  Does nothing outside a task.
+void green_yield(void);
+
+// pread(), but a task yields instead of blocking while the data is not
+// in the page cache.  Outside a task it is plain pread().
+ssize_t green_pread(int fd, void *buf, size_t count, off_t offset);
+
+// Wait for every task to finish, then stop the threads and free the
+// executor.
+int green_executor_shutdown(struct green_executor *ex);
+
+#endif
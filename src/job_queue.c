@@ -1,49 +1,952 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <sched.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
 
 #include "job_queue.h"
+#include "jq_internal.h"
 
-// Initialize the job queue with the given capacity. Returns 0 on success, -1 on failure.
+// ---------- Backend selection ----------
+
+static struct {
+  char const *name;
+  struct jq_ops const *ops;
+} const kinds[] = {
+  [JOB_QUEUE_MUTEX]     = { "mutex",     &jq_mutex_ops },
+  [JOB_QUEUE_LOCKFREE]  = { "lockfree",  &jq_lockfree_ops },
+  [JOB_QUEUE_PRIORITY]  = { "priority",  &jq_priority_ops },
+  [JOB_QUEUE_SEGMENTED] = { "segmented", &jq_segmented_ops },
+  [JOB_QUEUE_TWOLOCK]   = { "twolock",   &jq_twolock_ops },
+  [JOB_QUEUE_SPMC]      = { "spmc",      &jq_spmc_ops },
+  [JOB_QUEUE_SPSC]      = { "spsc",      &jq_spsc_ops },
+  [JOB_QUEUE_SHARDED]   = { "sharded",   &jq_sharded_ops },
+};
+
+#define NUM_KINDS ((int)(sizeof(kinds) / sizeof(kinds[0])))
+
+int job_queue_kind_parse(char const *name, enum job_queue_kind *kind) {
+  for (int i = 0; i < NUM_KINDS; i++) {
+    if (strcmp(name, kinds[i].name) == 0) {
+      *kind = (enum job_queue_kind)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+char const *job_queue_kind_name(enum job_queue_kind kind) {
+  if ((int)kind < 0 || (int)kind >= NUM_KINDS) {
+    return "unknown";
+  }
+  return kinds[kind].name;
+}
+
+// Defaults, overridable from the environment.  An unknown name in
+// JOB_QUEUE_KIND is ignored rather than treated as an error, so a typo
+// cannot stop a program from running.
+void job_queue_attr_init(struct job_queue_attr *attr) {
+  attr->kind = JOB_QUEUE_MUTEX;
+  attr->soft_cap = 0;
+  attr->shards = 0;
+  attr->elem_size = 0;
+  attr->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? JOB_QUEUE_DEFAULT_SPIN : 0;
+  char const *env = getenv("JOB_QUEUE_KIND");
+  if (env != NULL) {
+    job_queue_kind_parse(env, &attr->kind);
+  }
+  attr->ready_fd = 0;
+  attr->stats = 0;
+  env = getenv("JOB_QUEUE_STATS");
+  if (env != NULL) {
+    attr->stats = atoi(env) != 0;
+  }
+  env = getenv("JOB_QUEUE_SPIN");
+  if (env != NULL && atoi(env) >= 0) {
+    attr->spin = atoi(env);
+  }
+}
+
+// ---------- Readiness notification ----------
+//
+// 'ready_armed' is cleared by the first push to find it set, which is
+// then the only one to write to the eventfd until the reader has
+// acknowledged.  An acknowledgement empties the eventfd before
+// re-arming, so a push that comes after it always signals anew, and a
+// push that comes before it is seen by the pops that follow it.
+
+static void ready_signal(struct job_queue *jq, int force) {
+  if (jq->ready_fd < 0) {
+    return;
+  }
+  if (force || __atomic_exchange_n(&jq->ready_armed, 0, __ATOMIC_SEQ_CST)) {
+    uint64_t one = 1;
+    // Fails only if the counter would overflow, when it is readable anyway
+    (void)!write(jq->ready_fd, &one, sizeof(one));
+  }
+}
+
+static void ready_fd_close(struct job_queue *jq) {
+  if (jq->ready_fd >= 0) {
+    close(jq->ready_fd);
+    jq->ready_fd = -1;
+  }
+}
+
+// The distance between elements of the arrays handed to the backend:
+// inline elements, or pointers.
+static size_t elem_stride(struct job_queue const *jq) {
+  return jq->elem_size > 0 && jq->ops->inline_values ? jq->elem_size : sizeof(void *);
+}
+
+// Push through the backend, signalling the eventfd if anything went
+// in.  With an eventfd, the reader may be an event loop that only pops
+// once signalled, so signal before ever waiting for room: push what
+// fits, then wait for room for a single element, and so on.
+static int push(struct job_queue *jq, void *const *data,
+                long long const *weights, int n,
+                struct timespec const *deadline) {
+  if (jq->ready_fd < 0) {
+    return jq->ops->push_many(jq, data, weights, n, deadline);
+  }
+  size_t size = elem_stride(jq);
+  int pushed = 0;
+  while (pushed < n) {
+    void *const *rest = (void *const *)((char const *)data + pushed * size);
+    long long const *rest_weights = weights != NULL ? weights + pushed : NULL;
+    int r = jq->ops->push_many(jq, rest, rest_weights, n - pushed, JQ_NOWAIT);
+    if (r == 0) {
+      r = jq->ops->push_many(jq, rest, rest_weights, 1, deadline);
+    }
+    if (r == 0) {
+      break;
+    }
+    ready_signal(jq, 0);
+    pushed += r;
+  }
+  return pushed;
+}
+
+int job_queue_ready_fd(struct job_queue *job_queue) {
+  return job_queue->ready_fd;
+}
+
+void job_queue_ready_ack(struct job_queue *job_queue) {
+  if (job_queue->ready_fd < 0) {
+    return;
+  }
+  uint64_t count;
+  (void)!read(job_queue->ready_fd, &count, sizeof(count));
+  __atomic_store_n(&job_queue->ready_armed, 1, __ATOMIC_SEQ_CST);
+}
+
+// ---------- Public interface ----------
 
 int job_queue_init(struct job_queue *job_queue, int capacity) {
-  if (capacity <= 0) {
-    return -1; //capacity must be positive
+  return job_queue_init_attr(job_queue, capacity, NULL);
+}
+
+// Initialise the parts shared by all backends, then the backend itself.
+int job_queue_init_attr(struct job_queue *job_queue, int capacity,
+                        struct job_queue_attr const *attr) {
+  struct job_queue_attr defaults;
+  if (attr == NULL) {
+    job_queue_attr_init(&defaults);
+    attr = &defaults;
   }
-  job_queue->buffer = malloc(sizeof(void *) * capacity);
-  if (job_queue->buffer == NULL) {
-    return -1; //memory allocation failed
+  if (capacity <= 0 || (int)attr->kind < 0 || (int)attr->kind >= NUM_KINDS) {
+    return -1;
   }
+  job_queue->kind = attr->kind;
+  job_queue->ops = kinds[attr->kind].ops;
+  job_queue->impl = NULL;
+  job_queue->buffer = NULL;
   job_queue->capacity = capacity;
   job_queue->count = 0;
   job_queue->head = 0;
   job_queue->tail = 0;
   job_queue->destroyed = 0;
+  job_queue->elem_size = attr->elem_size;
+  job_queue->pop_waiters = 0;
+  job_queue->push_waiters = 0;
+  job_queue->active = 0;
+  job_queue->pushing = 0;
+  job_queue->drained = 0;
+  job_queue->pop_seq = 0;
+  job_queue->push_seq = 0;
+  job_queue->spin = attr->spin > 0 ? attr->spin : 0;
+  job_queue->spin_est = job_queue->spin / 2;
+  job_queue->stats_enabled = attr->stats;
+  job_queue->lock_since = 0;
+  memset(&job_queue->stats, 0, sizeof(job_queue->stats));
+  job_queue->ready_fd = -1;
+  job_queue->ready_armed = 1;
+  if (attr->ready_fd) {
+    job_queue->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (job_queue->ready_fd < 0) {
+      return -1;
+    }
+  }
   // Initialize mutex and condition variables
   if (pthread_mutex_init(&job_queue->mutex, NULL) != 0) {
-    free(job_queue->buffer);
+    ready_fd_close(job_queue);
     return -1;
   }
   if (pthread_cond_init(&job_queue->not_empty, NULL) != 0) {
     pthread_mutex_destroy(&job_queue->mutex);
-    free(job_queue->buffer);
+    ready_fd_close(job_queue);
     return -1;
   }
   if (pthread_cond_init(&job_queue->not_full, NULL) != 0) {
     pthread_cond_destroy(&job_queue->not_empty);
     pthread_mutex_destroy(&job_queue->mutex);
-    free(job_queue->buffer);
+    ready_fd_close(job_queue);
+    return -1;
+  }
+  if (job_queue->ops->init(job_queue, capacity, attr) != 0) {
+    pthread_cond_destroy(&job_queue->not_full);
+    pthread_cond_destroy(&job_queue->not_empty);
+    pthread_mutex_destroy(&job_queue->mutex);
+    ready_fd_close(job_queue);
+    return -1;
+  }
+  return 0;
+}
+
+int job_queue_destroy(struct job_queue *job_queue) {
+  if (job_queue->ready_fd < 0) {
+    return job_queue->ops->destroy(job_queue);
+  }
+  // An event loop may be the only consumer, so it must hear about the
+  // close before destroying waits for it to drain the queue
+  job_queue->ops->close(job_queue);
+  ready_signal(job_queue, 1);
+  int r = job_queue->ops->destroy(job_queue);
+  ready_fd_close(job_queue);
+  return r;
+}
+
+int job_queue_close(struct job_queue *job_queue) {
+  int r = job_queue->ops->close(job_queue);
+  ready_signal(job_queue, 1);
+  return r;
+}
+
+static int push_values(struct job_queue *jq, void const *elems,
+                       long long const *weights, int n,
+                       struct timespec const *deadline);
+static int pop_values(struct job_queue *jq, void *elems, int max,
+                      struct timespec const *deadline);
+
+// Pop without waiting until the queue reports that it is closed and
+// empty.  A pop that finds nothing while a push is still finishing
+// returns 0, so go round again.
+int job_queue_cancel(struct job_queue *job_queue, void (*discard)(void *data)) {
+  job_queue_close(job_queue);
+  void *stack[64];
+  char *batch = (char *)stack;
+  size_t size = job_queue->elem_size > 0 ? job_queue->elem_size : sizeof(void *);
+  int max = sizeof(stack) / size;
+  if (max == 0) {
+    batch = malloc(size);
+    if (batch == NULL) {
+      return -1;
+    }
+    max = 1;
+  }
+  int discarded = 0;
+  int n;
+  while ((n = pop_values(job_queue, batch, max, JQ_NOWAIT)) >= 0) {
+    for (int i = 0; i < n; i++) {
+      if (discard != NULL) {
+        // A queue of pointers hands out the pointers themselves
+        discard(job_queue->elem_size > 0 ? batch + i * size : ((void **)batch)[i]);
+      }
+    }
+    discarded += n;
+    if (n == 0) {
+      sched_yield();
+    }
+  }
+  if (batch != (char *)stack) {
+    free(batch);
+  }
+  return discarded;
+}
+
+int job_queue_push(struct job_queue *job_queue, void *data) {
+  return push(job_queue, &data, NULL, 1, NULL) == 1 ? 0 : -1;
+}
+
+int job_queue_pop(struct job_queue *job_queue, void **data) {
+  return job_queue->ops->pop_many(job_queue, data, 1, NULL) == 1 ? 0 : -1;
+}
+
+int job_queue_push_many(struct job_queue *job_queue, void *const *data, int n) {
+  if (n <= 0) {
+    return 0;
+  }
+  return push(job_queue, data, NULL, n, NULL);
+}
+
+int job_queue_pop_many(struct job_queue *job_queue, void **data, int max) {
+  if (max <= 0) {
+    return -1;
+  }
+  return job_queue->ops->pop_many(job_queue, data, max, NULL);
+}
+
+int job_queue_push_weighted(struct job_queue *job_queue, void *data,
+                            long long weight) {
+  return push(job_queue, &data, &weight, 1, NULL) == 1 ? 0 : -1;
+}
+
+int job_queue_push_many_weighted(struct job_queue *job_queue, void *const *data,
+                                 long long const *weights, int n) {
+  if (n <= 0) {
+    return 0;
+  }
+  return push(job_queue, data, weights, n, NULL);
+}
+
+int job_queue_try_push(struct job_queue *job_queue, void *data) {
+  if (push(job_queue, &data, NULL, 1, JQ_NOWAIT) == 1) {
+    return 0;
+  }
+  return __atomic_load_n(&job_queue->destroyed, __ATOMIC_SEQ_CST) ? -1 : 1;
+}
+
+int job_queue_try_pop(struct job_queue *job_queue, void **data) {
+  int r = job_queue->ops->pop_many(job_queue, data, 1, JQ_NOWAIT);
+  return r < 0 ? -1 : r == 0;
+}
+
+int job_queue_try_pop_many(struct job_queue *job_queue, void **data, int max) {
+  if (max <= 0) {
+    return -1;
+  }
+  return job_queue->ops->pop_many(job_queue, data, max, JQ_NOWAIT);
+}
+
+int job_queue_pop_timed(struct job_queue *job_queue, void **data,
+                        struct timespec const *deadline) {
+  int r = job_queue->ops->pop_many(job_queue, data, 1, deadline);
+  return r < 0 ? -1 : r == 0;
+}
+
+int job_queue_size(struct job_queue *job_queue) {
+  return job_queue->ops->size(job_queue);
+}
+
+// ---------- Inline values ----------
+//
+// Backends without inline_values see a pointer to a heap copy of each
+// element, made here on push and freed on pop.
+
+#define BOX_BATCH 64
+
+static int push_values(struct job_queue *jq, void const *elems,
+                       long long const *weights, int n,
+                       struct timespec const *deadline) {
+  if (jq->elem_size == 0 || jq->ops->inline_values) {
+    return push(jq, (void *const *)elems, weights, n, deadline);
+  }
+  void *boxes[BOX_BATCH];
+  int pushed = 0;
+  while (pushed < n) {
+    int want = n - pushed < BOX_BATCH ? n - pushed : BOX_BATCH;
+    int boxed = 0;
+    while (boxed < want && (boxes[boxed] = malloc(jq->elem_size)) != NULL) {
+      memcpy(boxes[boxed], (char const *)elems + (pushed + boxed) * jq->elem_size,
+             jq->elem_size);
+      boxed++;
+    }
+    int r = 0;
+    if (boxed > 0) {
+      r = push(jq, boxes, weights != NULL ? weights + pushed : NULL,
+               boxed, deadline);
+    }
+    for (int i = r; i < boxed; i++) {
+      free(boxes[i]);
+    }
+    pushed += r;
+    if (r < want) {
+      break;
+    }
+  }
+  return pushed;
+}
+
+static int pop_values(struct job_queue *jq, void *elems, int max,
+                      struct timespec const *deadline) {
+  if (jq->elem_size == 0 || jq->ops->inline_values) {
+    return jq->ops->pop_many(jq, elems, max, deadline);
+  }
+  void *boxes[BOX_BATCH];
+  int r = jq->ops->pop_many(jq, boxes, max < BOX_BATCH ? max : BOX_BATCH, deadline);
+  for (int i = 0; i < r; i++) {
+    memcpy((char *)elems + i * jq->elem_size, boxes[i], jq->elem_size);
+    free(boxes[i]);
+  }
+  return r;
+}
+
+int job_queue_push_value(struct job_queue *job_queue, void const *elem) {
+  return push_values(job_queue, elem, NULL, 1, NULL) == 1 ? 0 : -1;
+}
+
+int job_queue_pop_value(struct job_queue *job_queue, void *elem) {
+  return pop_values(job_queue, elem, 1, NULL) == 1 ? 0 : -1;
+}
+
+int job_queue_push_values(struct job_queue *job_queue, void const *elems,
+                          long long const *weights, int n) {
+  if (n <= 0) {
+    return 0;
+  }
+  return push_values(job_queue, elems, weights, n, NULL);
+}
+
+int job_queue_pop_values(struct job_queue *job_queue, void *elems, int max) {
+  if (max <= 0) {
+    return -1;
+  }
+  return pop_values(job_queue, elems, max, NULL);
+}
+
+int job_queue_pop_values_timed(struct job_queue *job_queue, void *elems, int max,
+                               struct timespec const *deadline) {
+  if (max <= 0) {
+    return -1;
+  }
+  return pop_values(job_queue, elems, max, deadline);
+}
+
+int job_queue_try_push_value(struct job_queue *job_queue, void const *elem) {
+  if (push_values(job_queue, elem, NULL, 1, JQ_NOWAIT) == 1) {
+    return 0;
+  }
+  return __atomic_load_n(&job_queue->destroyed, __ATOMIC_SEQ_CST) ? -1 : 1;
+}
+
+int job_queue_try_pop_values(struct job_queue *job_queue, void *elems, int max) {
+  if (max <= 0) {
+    return -1;
+  }
+  return pop_values(job_queue, elems, max, JQ_NOWAIT);
+}
+
+// ---------- Statistics ----------
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stat_add(unsigned long long *counter, unsigned long long n) {
+  __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+void jq_stats_sample(struct job_queue *jq, int pushed, int popped, int size) {
+  if (!jq->stats_enabled) {
+    return;
+  }
+  struct job_queue_stats *st = &jq->stats;
+  if (pushed > 0) {
+    stat_add(&st->pushes, pushed);
+  }
+  if (popped > 0) {
+    stat_add(&st->pops, popped);
+  }
+  int bucket = 0;
+  while (size >> bucket != 0 && bucket < JOB_QUEUE_OCCUPANCY_BUCKETS - 1) {
+    bucket++;
+  }
+  stat_add(&st->occupancy[bucket], 1);
+  if (size >= jq->capacity) {
+    stat_add(&st->full, 1);
+  }
+}
+
+// Account for a sleep of 'ns' nanoseconds waiting for room (or for an
+// element).
+static void stat_sleep(struct job_queue *jq, int push, unsigned long long ns) {
+  struct job_queue_stats *st = &jq->stats;
+  stat_add(push ? &st->push_waits : &st->pop_waits, 1);
+  stat_add(push ? &st->push_wait_ns : &st->pop_wait_ns, ns);
+}
+
+// The time the mutex is held is measured from when jq_lock() (or
+// jq_wait()) got it, which the holder records in 'lock_since'.
+
+void jq_lock(struct job_queue *jq) {
+  if (!jq->stats_enabled) {
+    assert(pthread_mutex_lock(&jq->mutex) == 0);
+    return;
+  }
+  if (pthread_mutex_trylock(&jq->mutex) == 0) {
+    jq->lock_since = now_ns();
+  } else {
+    unsigned long long start = now_ns();
+    assert(pthread_mutex_lock(&jq->mutex) == 0);
+    jq->lock_since = now_ns();
+    stat_add(&jq->stats.lock_contended, 1);
+    stat_add(&jq->stats.lock_wait_ns, jq->lock_since - start);
+  }
+  stat_add(&jq->stats.lock_acquires, 1);
+}
+
+void jq_unlock(struct job_queue *jq) {
+  if (jq->stats_enabled) {
+    stat_add(&jq->stats.lock_hold_ns, now_ns() - jq->lock_since);
+  }
+  assert(pthread_mutex_unlock(&jq->mutex) == 0);
+}
+
+int job_queue_stats(struct job_queue *job_queue, struct job_queue_stats *stats) {
+  if (!job_queue->stats_enabled) {
+    return -1;
+  }
+  // Every field is an unsigned long long counter
+  unsigned long long *src = (unsigned long long *)&job_queue->stats;
+  unsigned long long *dst = (unsigned long long *)stats;
+  for (size_t i = 0; i < sizeof(*stats) / sizeof(*dst); i++) {
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+static double ms(unsigned long long ns) {
+  return ns / 1e6;
+}
+
+void job_queue_stats_print(FILE *f, struct job_queue_stats const *stats) {
+  fprintf(f, "job queue: %llu pushes, %llu pops\n", stats->pushes, stats->pops);
+  fprintf(f, "  slept for room:     %llu times, %.3f ms\n",
+          stats->push_waits, ms(stats->push_wait_ns));
+  fprintf(f, "  slept for elements: %llu times, %.3f ms\n",
+          stats->pop_waits, ms(stats->pop_wait_ns));
+  if (stats->lock_acquires > 0) {
+    fprintf(f, "  lock: %llu acquisitions, %llu contended, %.3f ms waiting, %.3f ms held\n",
+            stats->lock_acquires, stats->lock_contended,
+            ms(stats->lock_wait_ns), ms(stats->lock_hold_ns));
+  }
+  unsigned long long samples = 0;
+  for (int b = 0; b < JOB_QUEUE_OCCUPANCY_BUCKETS; b++) {
+    samples += stats->occupancy[b];
+  }
+  if (samples == 0) {
+    return;
+  }
+  fprintf(f, "  occupancy (%llu samples, %.1f%% full):\n", samples,
+          100.0 * stats->full / samples);
+  for (int b = 0; b < JOB_QUEUE_OCCUPANCY_BUCKETS; b++) {
+    if (stats->occupancy[b] == 0) {
+      continue;
+    }
+    char label[32];
+    if (b == 0) {
+      snprintf(label, sizeof(label), "empty");
+    } else if (b == 1) {
+      snprintf(label, sizeof(label), "1");
+    } else if (b == JOB_QUEUE_OCCUPANCY_BUCKETS - 1) {
+      snprintf(label, sizeof(label), "%llu+", 1ULL << (b - 1));
+    } else {
+      snprintf(label, sizeof(label), "%llu-%llu", 1ULL << (b - 1), (1ULL << b) - 1);
+    }
+    fprintf(f, "    %13s: %5.1f%%\n", label, 100.0 * stats->occupancy[b] / samples);
+  }
+}
+
+// ---------- Waiting with deadlines ----------
+
+struct timespec const jq_nowait = { 0, 0 };
+
+int jq_wait(struct job_queue *jq, pthread_cond_t *cond,
+            struct timespec const *deadline) {
+  if (deadline == JQ_NOWAIT) {
+    return ETIMEDOUT;
+  }
+  unsigned long long start = 0;
+  if (jq->stats_enabled) {
+    start = now_ns();
+    stat_add(&jq->stats.lock_hold_ns, start - jq->lock_since);
+  }
+  int r;
+  if (deadline == NULL) {
+    r = pthread_cond_wait(cond, &jq->mutex);
+  } else {
+    r = pthread_cond_timedwait(cond, &jq->mutex, deadline);
+  }
+  if (jq->stats_enabled) {
+    jq->lock_since = now_ns();
+    stat_sleep(jq, cond == &jq->not_full, jq->lock_since - start);
+  }
+  return r;
+}
+
+// ---------- Adaptive spinning ----------
+//
+// Before sleeping, a waiter polls the queue for a while.  How long is
+// adapted as in glibc's adaptive mutexes: 'spin_est' follows the
+// number of polls recent waits took, and a waiter polls up to twice
+// that (but never more than the configured limit).  Waits that end
+// while spinning keep the estimate up; waits that spin in vain bring
+// it down, so that a queue that is idle for long stretches soon stops
+// burning CPU time.
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+static int spin_budget(struct job_queue *jq) {
+  int budget = __atomic_load_n(&jq->spin_est, __ATOMIC_RELAXED) * 2 + 10;
+  return budget < jq->spin ? budget : jq->spin;
+}
+
+static void spin_update(struct job_queue *jq, int spun) {
+  int est = __atomic_load_n(&jq->spin_est, __ATOMIC_RELAXED);
+  __atomic_store_n(&jq->spin_est, est + (spun - est) / 8, __ATOMIC_RELAXED);
+}
+
+void jq_spin_while(struct job_queue *jq, int const *word, int value,
+                   struct timespec const *deadline) {
+  if (jq->spin == 0 || deadline == JQ_NOWAIT) {
+    return;
+  }
+  int budget = spin_budget(jq);
+  jq_unlock(jq);
+  int spun = 0;
+  while (spun < budget && __atomic_load_n(word, __ATOMIC_RELAXED) == value &&
+         !__atomic_load_n(&jq->destroyed, __ATOMIC_RELAXED)) {
+    cpu_relax();
+    spun++;
+  }
+  jq_lock(jq);
+  spin_update(jq, spun);
+}
+
+// ---------- Parking for backends with non-blocking fast paths ----------
+//
+// Sleeping threads wait on a futex, 'pop_seq' for threads that found
+// the queue empty and 'push_seq' for threads that found it full.  A
+// thread that has spun in vain announces itself in pop_waiters
+// (push_waiters), reads the futex word and tries once more before
+// sleeping until the word changes.  The other side checks the waiter
+// count after making its change visible, and only then bumps the word
+// and wakes sleepers.  Because both sides use sequentially consistent
+// operations, either the sleeper sees the change or the waker sees the
+// sleeper, in which case the sleeper's futex wait returns at once if
+// the word has already moved on.  No lock is involved at all.
+//
+// 'pushing' counts threads inside a push, so that jq_park_destroy()
+// can wait for the last in-flight element before checking that the
+// queue is empty, and consumers of a closed queue do not give up while
+// an element may still arrive.  'active' counts threads inside any operation, so
+// that it knows when the backend state can be freed.
+
+// Sleep until '*seq' differs from 'seen', which may happen spuriously.
+// Returns non-zero if the deadline passed.
+static int park(unsigned *seq, unsigned seen, struct timespec const *deadline) {
+  if (deadline == JQ_NOWAIT) {
+    return ETIMEDOUT;
+  }
+  // FUTEX_WAIT_BITSET takes an absolute deadline, like everything
+  // else in job_queue; FUTEX_WAIT would want a relative one.
+  if (syscall(SYS_futex, seq,
+              FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME,
+              seen, deadline, NULL, FUTEX_BITSET_MATCH_ANY) != 0 &&
+      errno == ETIMEDOUT) {
+    return ETIMEDOUT;
+  }
+  return 0;
+}
+
+// park() in a push (or pop), keeping statistics.
+static int park_op(struct job_queue *jq, int push, unsigned seen,
+                   struct timespec const *deadline) {
+  unsigned *seq = push ? &jq->push_seq : &jq->pop_seq;
+  if (!jq->stats_enabled || deadline == JQ_NOWAIT) {
+    return park(seq, seen, deadline);
+  }
+  unsigned long long start = now_ns();
+  int r = park(seq, seen, deadline);
+  stat_sleep(jq, push, now_ns() - start);
+  return r;
+}
+
+static void wake(int *waiters, unsigned *seq, int all) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0) {
+    __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, seq, FUTEX_WAKE | FUTEX_PRIVATE_FLAG,
+            all ? INT_MAX : 1, NULL, NULL, 0);
+  }
+}
+
+static int enter(struct job_queue *jq) {
+  __atomic_add_fetch(&jq->active, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&jq->drained, __ATOMIC_SEQ_CST)) {
+    __atomic_sub_fetch(&jq->active, 1, __ATOMIC_SEQ_CST);
+    return -1;
+  }
+  return 0;
+}
+
+static void leave(struct job_queue *jq) {
+  __atomic_sub_fetch(&jq->active, 1, __ATOMIC_RELEASE);
+}
+
+static int is_destroyed(struct job_queue *jq) {
+  return __atomic_load_n(&jq->destroyed, __ATOMIC_SEQ_CST);
+}
+
+// Element 'i' of 'data' as try_push() takes it, and where try_pop()
+// puts element 'k' of 'data' (see jq_ops.inline_values).
+static void *park_elem(struct job_queue const *jq, void *const *data, int i) {
+  if (jq->elem_size > 0 && jq->ops->inline_values) {
+    return (char *)data + i * jq->elem_size;
+  }
+  return data[i];
+}
+
+static void **park_slot(struct job_queue const *jq, void **data, int k) {
+  return (void **)((char *)data + k * elem_stride(jq));
+}
+
+int jq_park_push_many(struct job_queue *jq, void *const *data,
+                      long long const *weights, int n,
+                      struct timespec const *deadline) {
+  (void)weights;
+  if (enter(jq) != 0) {
+    return 0;
+  }
+  __atomic_add_fetch(&jq->pushing, 1, __ATOMIC_SEQ_CST);
+  int i = 0;
+  int unwoken = 0;  // elements pushed since consumers were last woken
+  int timed_out = 0;
+  int spun = -1;    // not spun yet
+  while (i < n && !timed_out && !is_destroyed(jq)) {
+    if (jq->ops->try_push(jq, park_elem(jq, data, i)) == 0) {
+      i++;
+      unwoken++;
+      continue;
+    }
+    // Full.  Let the consumers at what we have before waiting.
+    if (unwoken > 0) {
+      wake(&jq->pop_waiters, &jq->pop_seq, unwoken > 1);
+      unwoken = 0;
+    }
+    if (deadline == JQ_NOWAIT) {
+      break;
+    }
+    if (spun < 0) {
+      int budget = spin_budget(jq);
+      int pushed = 0;
+      spun = 0;
+      while (spun < budget && !(pushed = jq->ops->try_push(jq, park_elem(jq, data, i)) == 0) &&
+             !is_destroyed(jq)) {
+        cpu_relax();
+        spun++;
+      }
+      spin_update(jq, spun);
+      if (pushed) {
+        i++;
+        unwoken++;
+      }
+      if (spun < budget) {
+        continue;
+      }
+    }
+    __atomic_add_fetch(&jq->push_waiters, 1, __ATOMIC_SEQ_CST);
+    unsigned seen = __atomic_load_n(&jq->push_seq, __ATOMIC_SEQ_CST);
+    if (!is_destroyed(jq)) {
+      if (jq->ops->try_push(jq, park_elem(jq, data, i)) == 0) {
+        i++;
+        unwoken++;
+      } else {
+        timed_out = park_op(jq, 1, seen, deadline) != 0;
+      }
+    }
+    __atomic_sub_fetch(&jq->push_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  __atomic_sub_fetch(&jq->pushing, 1, __ATOMIC_SEQ_CST);
+  jq_stats_sample(jq, i, 0, jq->ops->size(jq));
+  leave(jq);
+  if (unwoken > 0) {
+    wake(&jq->pop_waiters, &jq->pop_seq, unwoken > 1);
+  }
+  return i;
+}
+
+int jq_park_pop_many(struct job_queue *jq, void **data, int max,
+                     struct timespec const *deadline) {
+  if (enter(jq) != 0) {
     return -1;
   }
+  int k = 0;
+  int timed_out = 0;
+  int spun = -1;  // not spun yet
+  for (;;) {
+    while (k < max && jq->ops->try_pop(jq, park_slot(jq, data, k)) == 0) {
+      k++;
+    }
+    if (k > 0 || timed_out) {
+      break;
+    }
+    if (is_destroyed(jq) && __atomic_load_n(&jq->pushing, __ATOMIC_SEQ_CST) == 0 &&
+        jq->ops->size(jq) == 0) {
+      k = -1;
+      break;
+    }
+    if (deadline == JQ_NOWAIT) {
+      break;
+    }
+    if (spun < 0) {
+      int budget = spin_budget(jq);
+      spun = 0;
+      while (spun < budget && jq->ops->size(jq) == 0 && !is_destroyed(jq)) {
+        cpu_relax();
+        spun++;
+      }
+      spin_update(jq, spun);
+      if (spun < budget) {
+        continue;
+      }
+    }
+    __atomic_add_fetch(&jq->pop_waiters, 1, __ATOMIC_SEQ_CST);
+    unsigned seen = __atomic_load_n(&jq->pop_seq, __ATOMIC_SEQ_CST);
+    if (jq->ops->try_pop(jq, park_slot(jq, data, 0)) == 0) {
+      k = 1;  // go round once more to top up the batch
+    } else if (!is_destroyed(jq)) {
+      // After a timeout, go round once more for a last look.
+      timed_out = park_op(jq, 0, seen, deadline) != 0;
+    }
+    __atomic_sub_fetch(&jq->pop_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  jq_stats_sample(jq, 0, k, jq->ops->size(jq));
+  leave(jq);
+  if (k > 0) {
+    // Once destroyed, the only thread waiting for space is
+    // jq_park_destroy() itself, so make sure it is the one woken.
+    wake(&jq->push_waiters, &jq->push_seq, k > 1 || is_destroyed(jq));
+  }
+  return k;
+}
+
+int jq_park_close(struct job_queue *jq) {
+  __atomic_store_n(&jq->destroyed, 1, __ATOMIC_SEQ_CST);
+  // Producers blocked on a full queue give up, and consumers blocked on
+  // an empty one find out that nothing more will come
+  wake(&jq->push_waiters, &jq->push_seq, 1);
+  wake(&jq->pop_waiters, &jq->pop_seq, 1);
+  return 0;
+}
+
+int jq_park_destroy(struct job_queue *jq) {
+  // Producers give up...
+  jq_park_close(jq);
+  while (__atomic_load_n(&jq->pushing, __ATOMIC_SEQ_CST) > 0) {
+    sched_yield();
+  }
+  // ...while we wait for the consumers to drain what is left.
+  __atomic_add_fetch(&jq->push_waiters, 1, __ATOMIC_SEQ_CST);
+  for (;;) {
+    unsigned seen = __atomic_load_n(&jq->push_seq, __ATOMIC_SEQ_CST);
+    if (jq->ops->size(jq) == 0) {
+      break;
+    }
+    park(&jq->push_seq, seen, NULL);
+  }
+  __atomic_sub_fetch(&jq->push_waiters, 1, __ATOMIC_SEQ_CST);
+  // Queue is now empty, wake all waiting threads
+  __atomic_store_n(&jq->drained, 1, __ATOMIC_SEQ_CST);
+  wake(&jq->pop_waiters, &jq->pop_seq, 1);
+  // Threads still inside an operation may be looking at the backend
+  // state; they leave quickly now that the queue is drained.
+  while (__atomic_load_n(&jq->active, __ATOMIC_ACQUIRE) > 0) {
+    sched_yield();
+  }
+  jq->ops->fini(jq);
   return 0;
 }
 
+// ---------- Mutex backend ----------
+
+// Allocate the ring buffer, of pointers or of inline elements.  Returns
+// 0 on success, -1 on failure.
+
+static int mutex_init(struct job_queue *job_queue, int capacity,
+                      struct job_queue_attr const *attr) {
+  size_t size = attr->elem_size > 0 ? attr->elem_size : sizeof(void *);
+  job_queue->buffer = malloc(size * capacity);
+  if (job_queue->buffer == NULL) {
+    return -1; //memory allocation failed
+  }
+  return 0;
+}
+
+static void mutex_fini(struct job_queue *job_queue) {
+  free(job_queue->buffer);
+  job_queue->buffer = NULL;
+}
+
+// Close the job queue: mark it destroyed so that pushes fail, and wake
+// everyone so that blocked producers give up and consumers see it.
+
+int jq_mutex_close(struct job_queue *job_queue) {
+  assert(pthread_mutex_lock(&job_queue->mutex) == 0);
+  job_queue->destroyed = 1;
+  assert(pthread_cond_broadcast(&job_queue->not_full) == 0);
+  assert(pthread_cond_broadcast(&job_queue->not_empty) == 0);
+  assert(pthread_mutex_unlock(&job_queue->mutex) == 0);
+  return 0;
+}
+
+// Copy element 'i' of 'data' into slot 'slot' of the ring buffer, and
+// back.  'data' is an array of pointers unless the queue has inline
+// elements.
+
+static inline void slot_put(struct job_queue *job_queue, int slot,
+                            void *const *data, int i) {
+  if (job_queue->elem_size == 0) {
+    job_queue->buffer[slot] = data[i];
+  } else {
+    size_t size = job_queue->elem_size;
+    memcpy((char *)job_queue->buffer + slot * size, (char const *)data + i * size, size);
+  }
+}
+
+static inline void slot_get(struct job_queue *job_queue, int slot,
+                            void **data, int i) {
+  if (job_queue->elem_size == 0) {
+    data[i] = job_queue->buffer[slot];
+  } else {
+    size_t size = job_queue->elem_size;
+    memcpy((char *)data + i * size, (char const *)job_queue->buffer + slot * size, size);
+  }
+}
+
 // Destroy the job queue, freeing resources. Blocks until all jobs are processed.
 
-int job_queue_destroy(struct job_queue *job_queue) {
+int jq_mutex_destroy(struct job_queue *job_queue) {
   // Lock and mark the queue as destroyed
   assert(pthread_mutex_lock(&job_queue->mutex) == 0);
   job_queue->destroyed = 1;
+  // Producers blocked on a full queue give up
+  assert(pthread_cond_broadcast(&job_queue->not_full) == 0);
   // block until the queue is empty
   while (job_queue->count > 0) {
     assert(pthread_cond_wait(&job_queue->not_full, &job_queue->mutex) == 0);
@@ -53,62 +956,106 @@ int job_queue_destroy(struct job_queue *job_queue) {
   assert(pthread_cond_broadcast(&job_queue->not_full) == 0);
   assert(pthread_mutex_unlock(&job_queue->mutex) == 0);
   // free buffer memory
-  free(job_queue->buffer);
+  job_queue->ops->fini(job_queue);
   return 0;
 }
 
-// Push a new job onto the queue. Returns 0 on success, -1 if the queue is destroyed.
+// Push as many jobs as fit per lock hold, waking consumers once per
+// batch.  Returns the number of jobs pushed, which is short if the
+// queue is destroyed or the deadline passes while it is full.
 
-int job_queue_push(struct job_queue *job_queue, void *data) {
-  assert(pthread_mutex_lock(&job_queue->mutex) == 0);
-    // Error if queue has been destroyed
-    if (job_queue->destroyed) {
-        pthread_mutex_unlock(&job_queue->mutex);
-        return -1;
-    }
+static int mutex_push_many(struct job_queue *job_queue, void *const *data,
+                           long long const *weights, int n,
+                           struct timespec const *deadline) {
+  (void)weights;
+  int i = 0;
+  jq_lock(job_queue);
+  while (i < n) {
     // Queue is full, wait for space to become available
-    while (job_queue->count == job_queue->capacity && !job_queue->destroyed) {
-        assert(pthread_cond_wait(&job_queue->not_full, &job_queue->mutex) == 0);
-        if (job_queue->destroyed) {  // check again after waking up
-            pthread_mutex_unlock(&job_queue->mutex);
-            return -1;
-        }
-    }
-    if (job_queue->destroyed) {
-        // If destroyed while waiting, do not push
-        pthread_mutex_unlock(&job_queue->mutex);
-        return -1;
-    }
-    // Insert the new job at the tail of the circular buffer
-    job_queue->buffer[job_queue->tail] = data;
-    job_queue->tail = (job_queue->tail + 1) % job_queue->capacity;
-    job_queue->count++;
-    // Signal that the queue is not empty (wake one waiting consumer)
-    assert(pthread_cond_signal(&job_queue->not_empty) == 0);
-    assert(pthread_mutex_unlock(&job_queue->mutex) == 0);
-    return 0;
+    if (job_queue->count == job_queue->capacity && !job_queue->destroyed) {
+      jq_spin_while(job_queue, &job_queue->count, job_queue->capacity, deadline);
+    }
+    int timed_out = 0;
+    while (job_queue->count == job_queue->capacity && !job_queue->destroyed &&
+           !timed_out) {
+      timed_out = jq_wait(job_queue, &job_queue->not_full, deadline) != 0;
+    }
+    // Error if queue has been destroyed (possibly while we waited)
+    if (job_queue->destroyed || job_queue->count == job_queue->capacity) {
+      break;
+    }
+    // Insert as much of the batch as there is room for at the tail of
+    // the circular buffer
+    int added = 0;
+    while (i < n && job_queue->count < job_queue->capacity) {
+      slot_put(job_queue, job_queue->tail, data, i++);
+      job_queue->tail = (job_queue->tail + 1) % job_queue->capacity;
+      job_queue->count++;
+      added++;
+    }
+    // Signal that the queue is not empty, once for the whole batch
+    if (added == 1) {
+      assert(pthread_cond_signal(&job_queue->not_empty) == 0);
+    } else {
+      assert(pthread_cond_broadcast(&job_queue->not_empty) == 0);
+    }
+  }
+  jq_stats_sample(job_queue, i, 0, job_queue->count);
+  jq_unlock(job_queue);
+  return i;
 }
 
-// Pop a job from the queue. Returns 0 on success, -1 if the queue is destroyed and empty.
+// Pop up to 'max' jobs under one lock hold.  Returns the number of jobs
+// popped, 0 if the deadline passed while the queue was empty, or -1 if
+// the queue is destroyed and empty.
 
-int job_queue_pop(struct job_queue *job_queue, void **data) {
-   assert(pthread_mutex_lock(&job_queue->mutex) == 0);
-    // Queue is empty, wait for a job (unless destroyed)
-    while (job_queue->count == 0 && !job_queue->destroyed) {
-        assert(pthread_cond_wait(&job_queue->not_empty, &job_queue->mutex) == 0);
-    }
-    // If destroyed *and* no jobs remain, return -1 to signal termination
-    if (job_queue->destroyed && job_queue->count == 0) {
-        pthread_mutex_unlock(&job_queue->mutex);
-        return -1;  // queue has been shut down
-    }
-    // Remove the job from the head of the queue
-    assert(job_queue->count > 0);
-    *data = job_queue->buffer[job_queue->head];
+static int mutex_pop_many(struct job_queue *job_queue, void **data, int max,
+                          struct timespec const *deadline) {
+  jq_lock(job_queue);
+  // Queue is empty, wait for a job (unless destroyed)
+  if (job_queue->count == 0 && !job_queue->destroyed) {
+    jq_spin_while(job_queue, &job_queue->count, 0, deadline);
+  }
+  int timed_out = 0;
+  while (job_queue->count == 0 && !job_queue->destroyed && !timed_out) {
+    timed_out = jq_wait(job_queue, &job_queue->not_empty, deadline) != 0;
+  }
+  // If destroyed *and* no jobs remain, return -1 to signal termination
+  if (job_queue->destroyed && job_queue->count == 0) {
+    jq_unlock(job_queue);
+    return -1;  // queue has been shut down
+  }
+  // Remove jobs from the head of the queue
+  int k = 0;
+  while (k < max && job_queue->count > 0) {
+    slot_get(job_queue, job_queue->head, data, k++);
     job_queue->head = (job_queue->head + 1) % job_queue->capacity;
     job_queue->count--;
-    // Signal that the queue is not full (wake one waiting producer)
+  }
+  // Signal that the queue is not full (wake one waiting producer, or
+  // all of them if several slots were freed).  Once destroyed, make
+  // sure that job_queue_destroy() is among those woken.
+  if (k == 1 && !job_queue->destroyed) {
     assert(pthread_cond_signal(&job_queue->not_full) == 0);
-    assert(pthread_mutex_unlock(&job_queue->mutex) == 0);
-    return 0;
+  } else if (k > 0) {
+    assert(pthread_cond_broadcast(&job_queue->not_full) == 0);
+  }
+  jq_stats_sample(job_queue, 0, k, job_queue->count);
+  jq_unlock(job_queue);
+  return k;
+}
+
+static int mutex_size(struct job_queue *job_queue) {
+  return __atomic_load_n(&job_queue->count, __ATOMIC_RELAXED);
 }
+
+struct jq_ops const jq_mutex_ops = {
+  .init      = mutex_init,
+  .fini      = mutex_fini,
+  .destroy   = jq_mutex_destroy,
+  .close     = jq_mutex_close,
+  .push_many = mutex_push_many,
+  .pop_many  = mutex_pop_many,
+  .size      = mutex_size,
+  .inline_values = 1,
+};
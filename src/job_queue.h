@@ -2,6 +2,92 @@
 #define JOB_QUEUE_H
 
 #include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+// The available queue implementations.  All of them provide the same
+// blocking semantics; they differ in how threads synchronise on the
+// fast path, and some in the order elements come out or in whether
+// the capacity is a hard limit.  JOB_QUEUE_SHARDED is FIFO only within
+// each shard.  JOB_QUEUE_SPMC and JOB_QUEUE_SPSC are
+// only correct if at most one thread at a time pushes (and, for SPSC,
+// at most one thread pops); in exchange a push costs no atomic
+// read-modify-write and never waits for other threads.
+enum job_queue_kind {
+    JOB_QUEUE_MUTEX,     // ring buffer under one mutex and two condvars
+    JOB_QUEUE_LOCKFREE,  // bounded MPMC ring with per-slot sequence numbers
+    JOB_QUEUE_PRIORITY,  // heaviest element first (see job_queue_push_weighted)
+    JOB_QUEUE_SEGMENTED, // unbounded list of fixed-size segments
+    JOB_QUEUE_TWOLOCK,   // ring with separate producer and consumer locks
+    JOB_QUEUE_SPMC,      // one pushing thread, wait-free push
+    JOB_QUEUE_SPSC,      // one pushing and one popping thread
+    JOB_QUEUE_SHARDED,   // one small ring per CPU, popped locally first
+};
+
+// Options for job_queue_init_attr().  Always set up with
+// job_queue_attr_init() before changing individual fields.
+struct job_queue_attr {
+    enum job_queue_kind kind;
+    // JOB_QUEUE_SEGMENTED only: once this many elements are queued,
+    // pushes wait for room as with a bounded queue.  A push that
+    // starts below the cap is not split, so the queue can overshoot it
+    // by one batch.  0 (the default) means no limit.
+    int                 soft_cap;
+    // JOB_QUEUE_SHARDED only: the number of shards the capacity is
+    // split over.  0 (the default) means one per online CPU.
+    int                 shards;
+    // Size in bytes of the elements, if they are to be stored in the
+    // queue itself rather than as pointers (see job_queue_push_value()
+    // for the kinds that do so).  0 (the default) makes a queue of
+    // pointers.
+    size_t              elem_size;
+    // How long a thread that finds the queue empty (or full) may spin,
+    // in polls of the queue, before it goes to sleep.  Spinning saves
+    // the sleep and wakeup when the next element is only microseconds
+    // away.  The actual spin adapts to how long recent waits took, up
+    // to this limit.  0 means always sleep at once.
+    int                 spin;
+    // Keep the counters read by job_queue_stats().  Off by default, as
+    // timing every lock and sleep is not free.
+    int                 stats;
+    // Create an eventfd that signals when elements arrive, so that the
+    // queue can be waited on with poll() or epoll alongside other file
+    // descriptors (see job_queue_ready_fd()).  Off by default, as it
+    // costs a system call per push that finds the queue's reader idle.
+    int                 ready_fd;
+};
+
+// Buckets of the occupancy histogram: bucket 0 counts samples of an
+// empty queue, bucket b > 0 samples with 2^(b-1) <= size < 2^b, and
+// the last bucket all larger sizes.
+#define JOB_QUEUE_OCCUPANCY_BUCKETS 18
+
+// Counters kept by a queue with statistics enabled.  Times are in
+// nanoseconds.  The lock counters only apply to kinds that take the
+// queue mutex on every operation, and do not include
+// job_queue_destroy().
+struct job_queue_stats {
+    unsigned long long pushes;          // elements pushed
+    unsigned long long pops;            // elements popped
+    unsigned long long push_waits;      // sleeps waiting for room
+    unsigned long long push_wait_ns;
+    unsigned long long pop_waits;       // sleeps waiting for an element
+    unsigned long long pop_wait_ns;
+    unsigned long long lock_acquires;
+    unsigned long long lock_contended;  // acquisitions that had to wait
+    unsigned long long lock_wait_ns;
+    unsigned long long lock_hold_ns;
+    // Number of elements in the queue, sampled at the end of every push
+    // and pop, and how many of those samples found it full
+    unsigned long long occupancy[JOB_QUEUE_OCCUPANCY_BUCKETS];
+    unsigned long long full;
+};
+
+// Default spin limit (see job_queue_attr).  Roughly a few
+// microseconds, the cost of a sleep and wakeup.
+#define JOB_QUEUE_DEFAULT_SPIN 200
+
+struct jq_ops;
 
 struct job_queue {
     pthread_mutex_t mutex;
@@ -12,27 +98,223 @@ struct job_queue {
     int             count;
     int             head;
     int             tail;
-    int             destroyed;
+    int             destroyed;  // closed, or being destroyed
+    size_t          elem_size;  // 0 for a queue of pointers
+
+    // The backend chosen at initialisation.  JOB_QUEUE_MUTEX keeps its
+    // state in the fields above, and the other mutex-based kinds use
+    // at least the mutex, condition variables and 'count'.
+    // JOB_QUEUE_LOCKFREE, JOB_QUEUE_TWOLOCK and the kinds after them
+    // keep their state in 'impl' and park threads on the futex words
+    // below when the queue is empty or full.
+    enum job_queue_kind  kind;
+    const struct jq_ops *ops;
+    void                *impl;
+    int                  pop_waiters;   // threads parked on pop_seq
+    int                  push_waiters;  // threads parked on push_seq
+    int                  active;        // threads inside a push or pop
+    int                  pushing;       // threads inside a push
+    int                  drained;       // 'impl' is about to be freed
+    unsigned             pop_seq;       // futex words bumped to wake
+    unsigned             push_seq;      // poppers and pushers
+    int                  spin;          // spin limit from the attributes
+    int                  spin_est;      // recent spin length, adaptive
+    int                  stats_enabled;
+    int                  ready_fd;      // eventfd, or -1
+    int                  ready_armed;   // the next push must signal it
+    unsigned long long   lock_since;    // when the mutex was taken
+    struct job_queue_stats stats;
 };
 
+// Fill in the default attributes.  The kind defaults to
+// JOB_QUEUE_MUTEX, unless the JOB_QUEUE_KIND environment variable
+// names another kind (see job_queue_kind_parse()).  This lets every
+// program that calls job_queue_init() switch backend without being
+// recompiled.  Likewise the spin limit can be set with JOB_QUEUE_SPIN;
+// it defaults to JOB_QUEUE_DEFAULT_SPIN, or 0 on a single CPU, where
+// spinning only delays the thread that would end the wait.  Setting
+// JOB_QUEUE_STATS to a non-zero number enables statistics.
+void job_queue_attr_init(struct job_queue_attr *attr);
+
+// Look up a queue kind by name ("mutex", "lockfree", "priority",
+// "segmented", "twolock", "spmc", "spsc", "sharded").  Returns non-zero
+// if the name is unknown.
+int job_queue_kind_parse(char const *name, enum job_queue_kind *kind);
+
+// The name of a queue kind, as accepted by job_queue_kind_parse().
+char const *job_queue_kind_name(enum job_queue_kind kind);
+
 // Initialise a job queue with the given capacity.  The queue starts out
-// empty.  Returns non-zero on error.
+// empty.  Returns non-zero on error.  A JOB_QUEUE_SEGMENTED queue never
+// fills up (unless given a soft cap); it grows and shrinks in segments
+// of 'capacity' elements.  A few kinds round the capacity up to what
+// their layout can hold: JOB_QUEUE_LOCKFREE and JOB_QUEUE_SPMC need at
+// least two slots, so a capacity of 1 holds two elements, and
+// JOB_QUEUE_SHARDED rounds it up to a multiple of the number of
+// shards.
 int job_queue_init(struct job_queue *job_queue, int capacity);
 
+// Like job_queue_init(), but with explicit attributes.  Passing NULL
+// is the same as passing attributes from job_queue_attr_init().
+int job_queue_init_attr(struct job_queue *job_queue, int capacity,
+                        struct job_queue_attr const *attr);
+
 // Destroy the job queue.  Blocks until the queue is empty before it
 // is destroyed.
 int job_queue_destroy(struct job_queue *job_queue);
 
+// Close the job queue: from now on every push fails, and producers
+// blocked on a full queue give up.  Consumers go on popping what is
+// left, and get -1 (as after job_queue_destroy()) once the queue is
+// empty.  Does not block.  The queue must still be destroyed
+// afterwards, which then only waits for the last elements to be
+// popped.  Closing a closed queue does nothing.
+int job_queue_close(struct job_queue *job_queue);
+
+// Close the job queue and throw away the elements still in it, handing
+// each to 'discard' (unless NULL) so that the caller can free it.
+// Consumers blocked on the queue wake up and get -1; elements they pop
+// while job_queue_cancel() runs are theirs to deal with as usual.
+// Discarded elements count as popped in the statistics.  Returns the
+// number of elements discarded, or -1 if out of memory.  The caller
+// pops the elements it discards, so on a JOB_QUEUE_SPSC queue only the
+// one consumer may call it.
+int job_queue_cancel(struct job_queue *job_queue, void (*discard)(void *data));
+
 // Push an element onto the end of the job queue.  Blocks if the
 // job_queue is full (its size is equal to its capacity).  Returns
 // non-zero on error.  It is an error to push a job onto a queue that
-// has been destroyed.
+// has been closed or destroyed.
 int job_queue_push(struct job_queue *job_queue, void *data);
 
 // Pop an element from the front of the job queue.  Blocks if the
 // job_queue contains zero elements.  Returns non-zero on error.  If
-// job_queue_destroy() has been called (possibly after the call to
-// job_queue_pop() blocked), this function will return -1.
+// job_queue_destroy() or job_queue_close() has been called (possibly
+// after the call to job_queue_pop() blocked) and the queue is empty,
+// this function will return -1.
 int job_queue_pop(struct job_queue *job_queue, void **data);
 
+// Push the 'n' elements of 'data', in order.  Blocks while the
+// job_queue is full.  As many elements as fit are moved under a single
+// lock acquisition, and waiting consumers are woken once per such
+// batch rather than once per element.  Returns the number of elements
+// pushed, which is less than 'n' only if the queue has been closed;
+// the elements that were not pushed still belong to the caller.
+int job_queue_push_many(struct job_queue *job_queue, void *const *data, int n);
+
+// Pop at least one and at most 'max' elements into 'data'.  Blocks if
+// the job_queue contains zero elements.  Returns the number of
+// elements popped, or -1 under the same conditions as job_queue_pop().
+int job_queue_pop_many(struct job_queue *job_queue, void **data, int max);
+
+// Like job_queue_push(), but with a weight for the element.  A
+// JOB_QUEUE_PRIORITY queue pops the heaviest element first (elements
+// of equal weight in FIFO order); the other kinds ignore the weight.
+// Use it, for instance, to process the biggest files first.
+int job_queue_push_weighted(struct job_queue *job_queue, void *data,
+                            long long weight);
+
+// Like job_queue_push_many(), with a weight for each element.
+int job_queue_push_many_weighted(struct job_queue *job_queue, void *const *data,
+                                 long long const *weights, int n);
+
+// Push an element if there is room, without blocking.  Returns 0 on
+// success, 1 if the job_queue is full, and -1 if it has been closed.
+int job_queue_try_push(struct job_queue *job_queue, void *data);
+
+// Pop an element if there is one, without blocking.  Returns 0 on
+// success, 1 if the job_queue is empty, and -1 if it has been
+// closed and is empty.
+int job_queue_try_pop(struct job_queue *job_queue, void **data);
+
+// Pop up to 'max' elements without blocking.  Returns the number of
+// elements popped (0 if the job_queue is empty), or -1 if it has been
+// closed and is empty.
+int job_queue_try_pop_many(struct job_queue *job_queue, void **data, int max);
+
+// Like job_queue_pop(), but gives up at 'deadline', an absolute
+// CLOCK_REALTIME time as for pthread_cond_timedwait().  Returns 0 on
+// success, 1 if the deadline passed first, and -1 if the job_queue has
+// been closed and is empty.
+int job_queue_pop_timed(struct job_queue *job_queue, void **data,
+                        struct timespec const *deadline);
+
+// The number of elements in the queue.  Only a snapshot, which other
+// threads may change at once; with some kinds an approximation.
+int job_queue_size(struct job_queue *job_queue);
+
+// ---------- Inline values ----------
+//
+// A queue created with job_queue_attr.elem_size holds copies of
+// fixed-size elements instead of pointers, so that small jobs (a
+// number, a short path) need no malloc() in the producer and free() in
+// the consumer.  Use only the functions below with such a queue; the
+// pointer-based ones above would hand it pointers where it expects
+// elements.  On a queue of pointers, these functions treat each
+// pointer as an element of sizeof(void *) bytes.
+//
+// The ring buffers (JOB_QUEUE_MUTEX, JOB_QUEUE_LOCKFREE,
+// JOB_QUEUE_TWOLOCK, JOB_QUEUE_SPMC and JOB_QUEUE_SPSC) store the
+// elements in their slots.  The other kinds only store pointers, so
+// they keep each element in a heap copy made on push and freed on pop:
+// the same API works, but without the saving.  job_queue_cancel()
+// hands 'discard' a pointer to a copy of each element, valid during
+// the call.
+
+// Push a copy of the element at 'elem'.  Blocks while the queue is
+// full.  Returns non-zero on error, as for job_queue_push().
+int job_queue_push_value(struct job_queue *job_queue, void const *elem);
+
+// Pop an element into 'elem'.  Blocks while the queue is empty.
+// Returns non-zero on error, as for job_queue_pop().
+int job_queue_pop_value(struct job_queue *job_queue, void *elem);
+
+// Push the 'n' consecutive elements at 'elems', with a weight for each
+// (or NULL) as for job_queue_push_many_weighted().  Returns the number
+// pushed.
+int job_queue_push_values(struct job_queue *job_queue, void const *elems,
+                          long long const *weights, int n);
+
+// Pop at least one and at most 'max' elements into the array 'elems',
+// as for job_queue_pop_many().
+int job_queue_pop_values(struct job_queue *job_queue, void *elems, int max);
+
+// Like job_queue_pop_values(), but gives up at 'deadline' as for
+// job_queue_pop_timed().  Returns the number of elements popped, 0 if
+// the deadline passed first, or -1 if the queue has been closed and is
+// empty.
+int job_queue_pop_values_timed(struct job_queue *job_queue, void *elems, int max,
+                               struct timespec const *deadline);
+
+// Non-blocking versions, as for job_queue_try_push() and
+// job_queue_try_pop_many().
+int job_queue_try_push_value(struct job_queue *job_queue, void const *elem);
+int job_queue_try_pop_values(struct job_queue *job_queue, void *elems, int max);
+
+// ---------- Readiness notification ----------
+//
+// A queue created with job_queue_attr.ready_fd can be consumed from an
+// event loop instead of a blocked thread.  Its eventfd becomes readable
+// when elements are pushed, and when the queue is closed or destroyed.
+// On readiness, call job_queue_ready_ack() and then pop with the
+// non-blocking functions until the queue is empty (or closed and
+// empty): the descriptor only signals again for elements pushed after
+// the acknowledgement.  Other threads may pop from the queue as usual
+// meanwhile, so a readiness signal does not guarantee an element.
+
+// The queue's eventfd, or -1 if it has none.  It belongs to the queue
+// and is closed by job_queue_destroy().
+int job_queue_ready_fd(struct job_queue *job_queue);
+
+// Reset the descriptor to unreadable and re-arm it for the next push.
+void job_queue_ready_ack(struct job_queue *job_queue);
+
+// Read the counters of a queue created with statistics enabled; see
+// struct job_queue_stats.  May be called at any time, even after
+// job_queue_destroy().  Returns non-zero if statistics are disabled.
+int job_queue_stats(struct job_queue *job_queue, struct job_queue_stats *stats);
+
+// Print statistics in human-readable form.
+void job_queue_stats_print(FILE *f, struct job_queue_stats const *stats);
+
 #endif
@@ -0,0 +1,37 @@
+#ifndef JOB_TRACE_H
+#define JOB_TRACE_H
+
+// The job trace a thread_pool writes with thread_pool_attr.trace, and
+// trace_sim replays to predict how other settings would have done.
+//
+// A trace is a header followed by one record per job, in the byte
+// order of the machine that wrote it.  Records come in chunks from each
+// worker, so they are not in any particular order.  Times are in
+// nanoseconds since the pool was initialised.
+
+#include <stdint.h>
+
+#define JOB_TRACE_MAGIC "JOBTRC01"
+
+struct job_trace_header {
+    char     magic[8];      // JOB_TRACE_MAGIC, without the NUL
+    uint32_t nworkers;      // as passed to thread_pool_init()
+    uint32_t capacity;      // of the job queue
+    uint32_t batch;         // jobs taken at a time
+    uint32_t kind;          // enum job_queue_kind
+};
+
+// The job ran inside another one (thread_pool_spawn() ran it at once),
+// so its time is part of that job's too.
+#define JOB_TRACE_NESTED 1
+
+struct job_trace_record {
+    uint64_t queued_ns;     // when submitted
+    uint64_t started_ns;
+    uint64_t ended_ns;
+    int64_t  bytes;         // the job's weight at submission, or 0
+    uint32_t worker;        // the id of the worker that ran it
+    uint32_t flags;
+};
+
+#endif
@@ -0,0 +1,133 @@
+// Interface between job_queue.c and the individual queue backends.
+// Nothing outside the job queue implementation should include this.
+
+#ifndef JQ_INTERNAL_H
+#define JQ_INTERNAL_H
+
+#include <string.h>
+#include <time.h>
+
+#include "job_queue.h"
+
+// Deadline meaning "do not wait at all".  A NULL deadline means "wait
+// as long as it takes"; anything else is an absolute CLOCK_REALTIME
+// time, as for pthread_cond_timedwait().
+extern struct timespec const jq_nowait;
+#define JQ_NOWAIT (&jq_nowait)
+
+// Operations implemented by a backend.  'destroy' and 'close' have the
+// semantics documented in job_queue.h.  Backends whose fast path does not take
+// job_queue->mutex implement only 'try_push', 'try_pop' and 'size',
+// and use the jq_park_*() functions below for everything else.
+struct jq_ops {
+    // Set up the backend state.  The common fields of the queue (mutex,
+    // condition variables, counters) are already initialised.
+    int  (*init)(struct job_queue *jq, int capacity,
+                 struct job_queue_attr const *attr);
+    // Release the backend state.  Called once no thread can touch it.
+    void (*fini)(struct job_queue *jq);
+    int  (*destroy)(struct job_queue *jq);
+    int  (*close)(struct job_queue *jq);
+    // Push up to 'n' elements, waiting for room until 'deadline'.
+    // 'weights' is NULL or gives a weight for each element, which only
+    // ordered backends look at.  Returns the number pushed; fewer than
+    // 'n' if the deadline passed or the queue was closed.
+    int  (*push_many)(struct job_queue *jq, void *const *data,
+                      long long const *weights, int n,
+                      struct timespec const *deadline);
+    // Pop up to 'max' elements, waiting for the first one until
+    // 'deadline'.  Returns the number popped, 0 if the deadline passed,
+    // or -1 if the queue is closed and empty.
+    int  (*pop_many)(struct job_queue *jq, void **data, int max,
+                     struct timespec const *deadline);
+    // Non-blocking primitives without any shutdown checks, used by the
+    // parking code.  Return 0 on success and 1 if the queue was full
+    // (respectively empty).
+    int  (*try_push)(struct job_queue *jq, void *data);
+    int  (*try_pop)(struct job_queue *jq, void **data);
+    // Approximate number of queued elements.
+    int  (*size)(struct job_queue *jq);
+    // Non-zero if the backend stores elements of jq->elem_size bytes
+    // itself.  push_many() and pop_many() then take arrays of such
+    // elements, cast to 'void **', and try_push() and try_pop() a
+    // pointer to one element (see jq_slot_put() below); otherwise
+    // job_queue.c only ever hands them pointers, to heap copies of the
+    // elements.
+    int  inline_values;
+};
+
+// For backends with inline_values that park: the size of a slot's
+// element, and copying one into a slot and back.  'data' is what
+// try_push() (try_pop()) was given: the pointer to queue itself in a
+// queue of pointers, or else the address of the element.
+static inline size_t jq_slot_size(struct job_queue const *jq) {
+  return jq->elem_size > 0 ? jq->elem_size : sizeof(void *);
+}
+
+static inline void jq_slot_put(struct job_queue const *jq, void *slot, void *data) {
+  if (jq->elem_size == 0) {
+    *(void **)slot = data;
+  } else {
+    memcpy(slot, data, jq->elem_size);
+  }
+}
+
+static inline void jq_slot_get(struct job_queue const *jq, void const *slot, void **data) {
+  if (jq->elem_size == 0) {
+    *data = *(void *const *)slot;
+  } else {
+    memcpy(data, slot, jq->elem_size);
+  }
+}
+
+extern struct jq_ops const jq_mutex_ops;
+extern struct jq_ops const jq_lockfree_ops;
+extern struct jq_ops const jq_priority_ops;
+extern struct jq_ops const jq_segmented_ops;
+extern struct jq_ops const jq_twolock_ops;
+extern struct jq_ops const jq_spmc_ops;
+extern struct jq_ops const jq_spsc_ops;
+extern struct jq_ops const jq_sharded_ops;
+
+// For backends that use job_queue->mutex: take and release it in
+// push and pop, keeping the lock statistics if they are enabled.
+void jq_lock(struct job_queue *jq);
+void jq_unlock(struct job_queue *jq);
+
+// Wait on 'cond', which must be jq->not_full or jq->not_empty, until
+// 'deadline' (see above), with jq->mutex held as for
+// pthread_cond_wait().  Returns 0 if woken and non-zero if the
+// deadline passed.
+int jq_wait(struct job_queue *jq, pthread_cond_t *cond,
+            struct timespec const *deadline);
+
+// Count an operation that pushed and popped the given numbers of
+// elements, and sample the occupancy 'size', if statistics are
+// enabled.  Call while the backend state is still safe to look at.
+void jq_stats_sample(struct job_queue *jq, int pushed, int popped, int size);
+
+// For backends that wait on job_queue->mutex and its condition
+// variables: call with the mutex held before waiting for '*word' (such
+// as 'count') to change from 'value'.  Releases the mutex and spins for
+// a while (see job_queue_attr.spin), so that a short wait needs no
+// sleep, then takes the mutex again.
+void jq_spin_while(struct job_queue *jq, int const *word, int value,
+                   struct timespec const *deadline);
+
+// Blocking operations built on top of ops->try_push()/try_pop().
+// Threads spin and then sleep on a futex only when the queue is full
+// or empty.
+int jq_park_push_many(struct job_queue *jq, void *const *data,
+                      long long const *weights, int n,
+                      struct timespec const *deadline);
+int jq_park_pop_many(struct job_queue *jq, void **data, int max,
+                     struct timespec const *deadline);
+int jq_park_destroy(struct job_queue *jq);
+int jq_park_close(struct job_queue *jq);
+
+// 'destroy' and 'close' for backends that, like JOB_QUEUE_MUTEX, keep
+// 'count' under job_queue->mutex and wait on its condition variables.
+int jq_mutex_destroy(struct job_queue *jq);
+int jq_mutex_close(struct job_queue *jq);
+
+#endif
@@ -0,0 +1,146 @@
+// Lock-free bounded MPMC ring buffer (JOB_QUEUE_LOCKFREE).
+//
+// Every slot carries a sequence number that tells producers and
+// consumers whose turn it is.  A slot at position 'pos' is free for
+// the producer that claims 'pos' when seq == pos, and holds data for
+// the consumer that claims 'pos' when seq == pos + 1.  Claiming a
+// position is a single compare-and-swap on the shared enqueue or
+// dequeue counter, so producers and consumers never take a lock, and
+// only make a system call when they have to sleep.
+//
+// In a queue of values (job_queue_attr.elem_size), each slot holds the
+// element itself after its sequence number.
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "job_queue.h"
+#include "jq_internal.h"
+
+#define CACHE_LINE 64
+
+// A slot is followed by its element, padded so that the next slot's
+// sequence number is aligned.
+struct slot {
+  size_t seq;
+  char   data[];
+};
+
+struct lockfree {
+  char        *slots;
+  size_t       stride;    // bytes from one slot to the next
+  size_t       capacity;
+  // Keep the two counters on separate cache lines, so that producers
+  // and consumers do not invalidate each other's line on every claim.
+  char         pad0[CACHE_LINE];
+  size_t       enqueue_pos;
+  char         pad1[CACHE_LINE - sizeof(size_t)];
+  size_t       dequeue_pos;
+  char         pad2[CACHE_LINE - sizeof(size_t)];
+};
+
+static struct slot *slot_at(struct lockfree *lf, size_t pos) {
+  return (struct slot *)(lf->slots + pos % lf->capacity * lf->stride);
+}
+
+static int lockfree_init(struct job_queue *jq, int capacity,
+                         struct job_queue_attr const *attr) {
+  (void)attr;
+  // With a single slot, "published for position p" and "free for
+  // position p + 1" would be the same sequence number.
+  if (capacity < 2) {
+    capacity = 2;
+  }
+  struct lockfree *lf = calloc(1, sizeof(struct lockfree));
+  if (lf == NULL) {
+    return -1;
+  }
+  lf->stride = (sizeof(struct slot) + jq_slot_size(jq) + sizeof(size_t) - 1) /
+    sizeof(size_t) * sizeof(size_t);
+  lf->slots = malloc(lf->stride * capacity);
+  if (lf->slots == NULL) {
+    free(lf);
+    return -1;
+  }
+  lf->capacity = capacity;
+  for (int i = 0; i < capacity; i++) {
+    slot_at(lf, i)->seq = i;
+  }
+  jq->impl = lf;
+  return 0;
+}
+
+static void lockfree_fini(struct job_queue *jq) {
+  struct lockfree *lf = jq->impl;
+  free(lf->slots);
+  free(lf);
+  jq->impl = NULL;
+}
+
+static int lockfree_try_push(struct job_queue *jq, void *data) {
+  struct lockfree *lf = jq->impl;
+  size_t pos = __atomic_load_n(&lf->enqueue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    struct slot *s = slot_at(lf, pos);
+    size_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&lf->enqueue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        jq_slot_put(jq, s->data, data);
+        __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+        return 0;
+      }
+      // Lost the race; 'pos' now holds the current counter.
+    } else if (diff < 0) {
+      // The slot still holds data from the previous lap: full.
+      return 1;
+    } else {
+      pos = __atomic_load_n(&lf->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static int lockfree_try_pop(struct job_queue *jq, void **data) {
+  struct lockfree *lf = jq->impl;
+  size_t pos = __atomic_load_n(&lf->dequeue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    struct slot *s = slot_at(lf, pos);
+    size_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&lf->dequeue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        jq_slot_get(jq, s->data, data);
+        // Hand the slot to the producer of the next lap.
+        __atomic_store_n(&s->seq, pos + lf->capacity, __ATOMIC_RELEASE);
+        return 0;
+      }
+    } else if (diff < 0) {
+      // Nothing has been published here yet: empty.
+      return 1;
+    } else {
+      pos = __atomic_load_n(&lf->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static int lockfree_size(struct job_queue *jq) {
+  struct lockfree *lf = jq->impl;
+  size_t head = __atomic_load_n(&lf->dequeue_pos, __ATOMIC_SEQ_CST);
+  size_t tail = __atomic_load_n(&lf->enqueue_pos, __ATOMIC_SEQ_CST);
+  return tail > head ? (int)(tail - head) : 0;
+}
+
+struct jq_ops const jq_lockfree_ops = {
+  .init      = lockfree_init,
+  .fini      = lockfree_fini,
+  .destroy   = jq_park_destroy,
+  .close     = jq_park_close,
+  .push_many = jq_park_push_many,
+  .pop_many  = jq_park_pop_many,
+  .try_push  = lockfree_try_push,
+  .try_pop   = lockfree_try_pop,
+  .size      = lockfree_size,
+  .inline_values = 1,
+};
@@ -0,0 +1,181 @@
+// Weighted priority queue (JOB_QUEUE_PRIORITY).
+//
+// A binary max-heap under job_queue->mutex, so that the heaviest
+// element is popped first.  When the weight is the amount of work an
+// element stands for (such as a file size), this schedules the longest
+// jobs first, which keeps one huge job from being started last and
+// leaving every other worker idle while it finishes.  A sequence
+// number breaks ties, so equal weights come out in FIFO order.
+//
+// Locking, waiting and shutdown work exactly as for JOB_QUEUE_MUTEX;
+// only the buffer differs.
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "job_queue.h"
+#include "jq_internal.h"
+
+struct entry {
+  long long          weight;
+  unsigned long long seq;
+  void              *data;
+};
+
+struct heap {
+  struct entry      *entries;   // 'count' entries, heap-ordered
+  unsigned long long next_seq;
+};
+
+// Does 'a' come out before 'b'?
+static int before(struct entry const *a, struct entry const *b) {
+  if (a->weight != b->weight) {
+    return a->weight > b->weight;
+  }
+  return a->seq < b->seq;
+}
+
+static void sift_up(struct entry *e, int i) {
+  struct entry x = e[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!before(&x, &e[parent])) {
+      break;
+    }
+    e[i] = e[parent];
+    i = parent;
+  }
+  e[i] = x;
+}
+
+static void sift_down(struct entry *e, int n, int i) {
+  struct entry x = e[i];
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= n) {
+      break;
+    }
+    if (child + 1 < n && before(&e[child + 1], &e[child])) {
+      child++;
+    }
+    if (!before(&e[child], &x)) {
+      break;
+    }
+    e[i] = e[child];
+    i = child;
+  }
+  e[i] = x;
+}
+
+static int priority_init(struct job_queue *jq, int capacity,
+                         struct job_queue_attr const *attr) {
+  (void)attr;
+  struct heap *h = calloc(1, sizeof(struct heap));
+  if (h == NULL) {
+    return -1;
+  }
+  h->entries = malloc(sizeof(struct entry) * capacity);
+  if (h->entries == NULL) {
+    free(h);
+    return -1;
+  }
+  jq->impl = h;
+  return 0;
+}
+
+static void priority_fini(struct job_queue *jq) {
+  struct heap *h = jq->impl;
+  free(h->entries);
+  free(h);
+  jq->impl = NULL;
+}
+
+// Same structure as the JOB_QUEUE_MUTEX push_many, inserting into the
+// heap instead of at the tail of a ring.
+
+static int priority_push_many(struct job_queue *jq, void *const *data,
+                              long long const *weights, int n,
+                              struct timespec const *deadline) {
+  struct heap *h = jq->impl;
+  int i = 0;
+  jq_lock(jq);
+  while (i < n) {
+    if (jq->count == jq->capacity && !jq->destroyed) {
+      jq_spin_while(jq, &jq->count, jq->capacity, deadline);
+    }
+    int timed_out = 0;
+    while (jq->count == jq->capacity && !jq->destroyed && !timed_out) {
+      timed_out = jq_wait(jq, &jq->not_full, deadline) != 0;
+    }
+    if (jq->destroyed || jq->count == jq->capacity) {
+      break;
+    }
+    int added = 0;
+    while (i < n && jq->count < jq->capacity) {
+      struct entry *e = &h->entries[jq->count];
+      e->weight = weights != NULL ? weights[i] : 0;
+      e->seq = h->next_seq++;
+      e->data = data[i++];
+      sift_up(h->entries, jq->count);
+      jq->count++;
+      added++;
+    }
+    if (added == 1) {
+      assert(pthread_cond_signal(&jq->not_empty) == 0);
+    } else {
+      assert(pthread_cond_broadcast(&jq->not_empty) == 0);
+    }
+  }
+  jq_stats_sample(jq, i, 0, jq->count);
+  jq_unlock(jq);
+  return i;
+}
+
+static int priority_pop_many(struct job_queue *jq, void **data, int max,
+                             struct timespec const *deadline) {
+  struct heap *h = jq->impl;
+  jq_lock(jq);
+  if (jq->count == 0 && !jq->destroyed) {
+    jq_spin_while(jq, &jq->count, 0, deadline);
+  }
+  int timed_out = 0;
+  while (jq->count == 0 && !jq->destroyed && !timed_out) {
+    timed_out = jq_wait(jq, &jq->not_empty, deadline) != 0;
+  }
+  if (jq->destroyed && jq->count == 0) {
+    jq_unlock(jq);
+    return -1;
+  }
+  int k = 0;
+  while (k < max && jq->count > 0) {
+    data[k++] = h->entries[0].data;
+    jq->count--;
+    if (jq->count > 0) {
+      h->entries[0] = h->entries[jq->count];
+      sift_down(h->entries, jq->count, 0);
+    }
+  }
+  // See mutex_pop_many() on why job_queue_destroy() needs a broadcast
+  if (k == 1 && !jq->destroyed) {
+    assert(pthread_cond_signal(&jq->not_full) == 0);
+  } else if (k > 0) {
+    assert(pthread_cond_broadcast(&jq->not_full) == 0);
+  }
+  jq_stats_sample(jq, 0, k, jq->count);
+  jq_unlock(jq);
+  return k;
+}
+
+static int priority_size(struct job_queue *jq) {
+  return __atomic_load_n(&jq->count, __ATOMIC_RELAXED);
+}
+
+struct jq_ops const jq_priority_ops = {
+  .init      = priority_init,
+  .fini      = priority_fini,
+  .destroy   = jq_mutex_destroy,
+  .close     = jq_mutex_close,
+  .push_many = priority_push_many,
+  .pop_many  = priority_pop_many,
+  .size      = priority_size,
+};
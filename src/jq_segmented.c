@@ -0,0 +1,175 @@
+// Unbounded segmented queue (JOB_QUEUE_SEGMENTED).
+//
+// A FIFO under job_queue->mutex made of a linked list of fixed-size
+// segments.  Producers append a new segment when the last one is full
+// and consumers unlink a segment once they have emptied it, so pushing
+// never waits for consumers.  A producer such as a directory walker
+// can then run ahead of slow workers instead of stalling whenever the
+// queue is briefly full.  The optional soft cap (see job_queue_attr)
+// bounds memory use if the producer is much faster than the consumers.
+//
+// One emptied segment is kept as a spare, so a queue that hovers
+// around a segment boundary does not call malloc() on every push.
+
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "job_queue.h"
+#include "jq_internal.h"
+
+struct segment {
+  struct segment *next;
+  void           *slots[];
+};
+
+struct segmented {
+  struct segment *head;      // consumers take from here...
+  struct segment *tail;      // ...and producers append here
+  int             head_pos;  // next slot to pop in 'head'
+  int             tail_pos;  // next slot to fill in 'tail'
+  int             seg_size;
+  struct segment *spare;
+};
+
+static struct segment *segment_new(struct segmented *sq) {
+  struct segment *seg = sq->spare;
+  if (seg != NULL) {
+    sq->spare = NULL;
+  } else {
+    seg = malloc(sizeof(struct segment) + sizeof(void *) * sq->seg_size);
+    if (seg == NULL) {
+      return NULL;
+    }
+  }
+  seg->next = NULL;
+  return seg;
+}
+
+static int segmented_init(struct job_queue *jq, int capacity,
+                          struct job_queue_attr const *attr) {
+  struct segmented *sq = calloc(1, sizeof(struct segmented));
+  if (sq == NULL) {
+    return -1;
+  }
+  sq->seg_size = capacity;
+  sq->head = sq->tail = segment_new(sq);
+  if (sq->head == NULL) {
+    free(sq);
+    return -1;
+  }
+  // 'capacity' is the segment size; the queue itself is bounded only
+  // by the soft cap
+  jq->capacity = attr->soft_cap > 0 ? attr->soft_cap : INT_MAX;
+  jq->impl = sq;
+  return 0;
+}
+
+static void segmented_fini(struct job_queue *jq) {
+  struct segmented *sq = jq->impl;
+  while (sq->head != NULL) {
+    struct segment *next = sq->head->next;
+    free(sq->head);
+    sq->head = next;
+  }
+  free(sq->spare);
+  free(sq);
+  jq->impl = NULL;
+}
+
+// Same structure as the JOB_QUEUE_MUTEX push_many, except that only the
+// soft cap makes producers wait, and once admitted a batch is pushed in
+// full.  Returns short if the queue is destroyed, the deadline passes,
+// or a new segment cannot be allocated.
+
+static int segmented_push_many(struct job_queue *jq, void *const *data,
+                               long long const *weights, int n,
+                               struct timespec const *deadline) {
+  (void)weights;
+  struct segmented *sq = jq->impl;
+  jq_lock(jq);
+  int timed_out = 0;
+  while (jq->count >= jq->capacity && !jq->destroyed && !timed_out) {
+    timed_out = jq_wait(jq, &jq->not_full, deadline) != 0;
+  }
+  int i = 0;
+  if (!jq->destroyed && jq->count < jq->capacity) {
+    while (i < n) {
+      if (sq->tail_pos == sq->seg_size) {
+        struct segment *seg = segment_new(sq);
+        if (seg == NULL) {
+          break;
+        }
+        sq->tail->next = seg;
+        sq->tail = seg;
+        sq->tail_pos = 0;
+      }
+      sq->tail->slots[sq->tail_pos++] = data[i++];
+      jq->count++;
+    }
+  }
+  if (i == 1) {
+    assert(pthread_cond_signal(&jq->not_empty) == 0);
+  } else if (i > 1) {
+    assert(pthread_cond_broadcast(&jq->not_empty) == 0);
+  }
+  jq_stats_sample(jq, i, 0, jq->count);
+  jq_unlock(jq);
+  return i;
+}
+
+static int segmented_pop_many(struct job_queue *jq, void **data, int max,
+                              struct timespec const *deadline) {
+  struct segmented *sq = jq->impl;
+  jq_lock(jq);
+  if (jq->count == 0 && !jq->destroyed) {
+    jq_spin_while(jq, &jq->count, 0, deadline);
+  }
+  int timed_out = 0;
+  while (jq->count == 0 && !jq->destroyed && !timed_out) {
+    timed_out = jq_wait(jq, &jq->not_empty, deadline) != 0;
+  }
+  if (jq->destroyed && jq->count == 0) {
+    jq_unlock(jq);
+    return -1;
+  }
+  int k = 0;
+  while (k < max && jq->count > 0) {
+    if (sq->head_pos == sq->seg_size) {
+      // Elements remain, so there is a next segment
+      struct segment *old = sq->head;
+      sq->head = old->next;
+      sq->head_pos = 0;
+      if (sq->spare == NULL) {
+        sq->spare = old;
+      } else {
+        free(old);
+      }
+    }
+    data[k++] = sq->head->slots[sq->head_pos++];
+    jq->count--;
+  }
+  // See mutex_pop_many() on why job_queue_destroy() needs a broadcast
+  if (k == 1 && !jq->destroyed) {
+    assert(pthread_cond_signal(&jq->not_full) == 0);
+  } else if (k > 0) {
+    assert(pthread_cond_broadcast(&jq->not_full) == 0);
+  }
+  jq_stats_sample(jq, 0, k, jq->count);
+  jq_unlock(jq);
+  return k;
+}
+
+static int segmented_size(struct job_queue *jq) {
+  return __atomic_load_n(&jq->count, __ATOMIC_RELAXED);
+}
+
+struct jq_ops const jq_segmented_ops = {
+  .init      = segmented_init,
+  .fini      = segmented_fini,
+  .destroy   = jq_mutex_destroy,
+  .close     = jq_mutex_close,
+  .push_many = segmented_push_many,
+  .pop_many  = segmented_pop_many,
+  .size      = segmented_size,
+};
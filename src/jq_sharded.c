@@ -0,0 +1,185 @@
+// Sharded queue (JOB_QUEUE_SHARDED).
+//
+// On a machine with many cores, every queue above has one hot spot
+// that all threads fight over, be it a mutex or a pair of counters.
+// Here the queue is split into shards, by default one per CPU, each a
+// small ring under its own lock on its own cache lines.  A consumer
+// first looks in the shard of the CPU it is running on and only then
+// scans the others, so consumers spread over the CPUs mostly stay out
+// of each other's way.  Producers deal their elements out round-robin
+// from a per-thread cursor, so that a single producer (a directory
+// walker, say) fills every shard rather than just its own.
+//
+// The price is that the queue is only roughly FIFO: elements come out
+// of each shard in order, but not in order across shards.
+//
+// Sleeping is left to the jq_park_*() functions, as for
+// JOB_QUEUE_LOCKFREE.
+
+// For sched_getcpu()
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "job_queue.h"
+#include "jq_internal.h"
+
+#define CACHE_LINE 64
+
+struct shard {
+  pthread_mutex_t lock;
+  void          **slots;
+  int             head;
+  int             count;
+};
+
+struct shard_padded {
+  struct shard s;
+  char         pad[CACHE_LINE - sizeof(struct shard) % CACHE_LINE];
+};
+
+struct sharded {
+  struct shard_padded *shards;
+  int                  nshards;
+  int                  shard_cap;
+};
+
+// Where this thread's next push starts looking.  Shared by all sharded
+// queues, which does no harm: it only needs to keep moving.
+static __thread unsigned next_shard;
+static __thread int next_shard_set;
+
+static int sharded_init(struct job_queue *jq, int capacity,
+                        struct job_queue_attr const *attr) {
+  int nshards = attr->shards;
+  if (nshards <= 0) {
+    nshards = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (nshards < 1) {
+    nshards = 1;
+  }
+  // Never more shards than elements, so that every shard holds at
+  // least one; the total capacity is rounded up to a multiple of the
+  // number of shards.
+  if (nshards > capacity) {
+    nshards = capacity;
+  }
+  struct sharded *sq = malloc(sizeof(struct sharded));
+  if (sq == NULL) {
+    return -1;
+  }
+  void *mem;
+  if (posix_memalign(&mem, CACHE_LINE, sizeof(struct shard_padded) * nshards) != 0) {
+    free(sq);
+    return -1;
+  }
+  sq->shards = mem;
+  sq->nshards = nshards;
+  sq->shard_cap = (capacity + nshards - 1) / nshards;
+  for (int i = 0; i < nshards; i++) {
+    struct shard *s = &sq->shards[i].s;
+    s->slots = malloc(sizeof(void *) * sq->shard_cap);
+    if (s->slots == NULL) {
+      while (i-- > 0) {
+        pthread_mutex_destroy(&sq->shards[i].s.lock);
+        free(sq->shards[i].s.slots);
+      }
+      free(sq->shards);
+      free(sq);
+      return -1;
+    }
+    s->head = 0;
+    s->count = 0;
+    pthread_mutex_init(&s->lock, NULL);
+  }
+  jq->impl = sq;
+  return 0;
+}
+
+static void sharded_fini(struct job_queue *jq) {
+  struct sharded *sq = jq->impl;
+  for (int i = 0; i < sq->nshards; i++) {
+    pthread_mutex_destroy(&sq->shards[i].s.lock);
+    free(sq->shards[i].s.slots);
+  }
+  free(sq->shards);
+  free(sq);
+  jq->impl = NULL;
+}
+
+// The shard of the CPU we are running on.
+static int local_shard(struct sharded *sq) {
+  int cpu = sched_getcpu();
+  return cpu < 0 ? 0 : cpu % sq->nshards;
+}
+
+static int sharded_try_push(struct job_queue *jq, void *data) {
+  struct sharded *sq = jq->impl;
+  if (!next_shard_set) {
+    next_shard = local_shard(sq);
+    next_shard_set = 1;
+  }
+  unsigned start = next_shard++;
+  for (int i = 0; i < sq->nshards; i++) {
+    struct shard *s = &sq->shards[(start + i) % sq->nshards].s;
+    // Skip shards that look full without touching their lock
+    if (__atomic_load_n(&s->count, __ATOMIC_ACQUIRE) == sq->shard_cap) {
+      continue;
+    }
+    pthread_mutex_lock(&s->lock);
+    if (s->count < sq->shard_cap) {
+      s->slots[(s->head + s->count) % sq->shard_cap] = data;
+      __atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELEASE);
+      pthread_mutex_unlock(&s->lock);
+      return 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+  return 1;
+}
+
+static int sharded_try_pop(struct job_queue *jq, void **data) {
+  struct sharded *sq = jq->impl;
+  int start = local_shard(sq);
+  for (int i = 0; i < sq->nshards; i++) {
+    struct shard *s = &sq->shards[(start + i) % sq->nshards].s;
+    // Likewise skip shards that look empty
+    if (__atomic_load_n(&s->count, __ATOMIC_ACQUIRE) == 0) {
+      continue;
+    }
+    pthread_mutex_lock(&s->lock);
+    if (s->count > 0) {
+      *data = s->slots[s->head];
+      s->head = (s->head + 1) % sq->shard_cap;
+      __atomic_store_n(&s->count, s->count - 1, __ATOMIC_RELEASE);
+      pthread_mutex_unlock(&s->lock);
+      return 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+  return 1;
+}
+
+static int sharded_size(struct job_queue *jq) {
+  struct sharded *sq = jq->impl;
+  int size = 0;
+  for (int i = 0; i < sq->nshards; i++) {
+    size += __atomic_load_n(&sq->shards[i].s.count, __ATOMIC_SEQ_CST);
+  }
+  return size;
+}
+
+struct jq_ops const jq_sharded_ops = {
+  .init      = sharded_init,
+  .fini      = sharded_fini,
+  .destroy   = jq_park_destroy,
+  .close     = jq_park_close,
+  .push_many = jq_park_push_many,
+  .pop_many  = jq_park_pop_many,
+  .try_push  = sharded_try_push,
+  .try_pop   = sharded_try_pop,
+  .size      = sharded_size,
+};
@@ -0,0 +1,235 @@
+// Single-producer ring buffers (JOB_QUEUE_SPMC and JOB_QUEUE_SPSC).
+//
+// Most producers in this project are one thread: an fts walk or a
+// getline() loop.  With a single producer, pushing needs no
+// read-modify-write at all, so it is wait-free: a push either finds
+// the next slot free and fills it, or reports the ring full, in a
+// bounded number of steps.
+//
+// JOB_QUEUE_SPMC lets any number of consumers pop.  Slots carry
+// sequence numbers as in JOB_QUEUE_LOCKFREE, and consumers claim them
+// with a compare-and-swap on the dequeue counter, but the producer
+// just checks that its next slot has been handed back.
+//
+// JOB_QUEUE_SPSC allows a single consumer as well, for one stage of a
+// pipeline feeding the next.  It is a Lamport ring where each side
+// only reads the other side's index when its cached copy says the
+// ring is full (or empty).
+//
+// Both keep the elements of a queue of values in their slots.
+// Sleeping is left to the jq_park_*() functions.  Nothing checks that
+// the callers keep to the single-thread promise.
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "job_queue.h"
+#include "jq_internal.h"
+
+#define CACHE_LINE 64
+
+// ---------- SPMC ----------
+
+// As in JOB_QUEUE_LOCKFREE, each slot is followed by its element.
+struct spmc_slot {
+  size_t seq;
+  char   data[];
+};
+
+struct spmc {
+  char             *slots;
+  size_t            stride;   // bytes from one slot to the next
+  size_t            capacity;
+  char              pad0[CACHE_LINE];
+  size_t            enqueue_pos;  // written by the producer only
+  char              pad1[CACHE_LINE - sizeof(size_t)];
+  size_t            dequeue_pos;
+  char              pad2[CACHE_LINE - sizeof(size_t)];
+};
+
+static struct spmc_slot *spmc_slot_at(struct spmc *q, size_t pos) {
+  return (struct spmc_slot *)(q->slots + pos % q->capacity * q->stride);
+}
+
+static int spmc_init(struct job_queue *jq, int capacity,
+                     struct job_queue_attr const *attr) {
+  (void)attr;
+  // See lockfree_init() on why a single slot will not do.
+  if (capacity < 2) {
+    capacity = 2;
+  }
+  struct spmc *q = calloc(1, sizeof(struct spmc));
+  if (q == NULL) {
+    return -1;
+  }
+  q->stride = (sizeof(struct spmc_slot) + jq_slot_size(jq) + sizeof(size_t) - 1) /
+    sizeof(size_t) * sizeof(size_t);
+  q->slots = malloc(q->stride * capacity);
+  if (q->slots == NULL) {
+    free(q);
+    return -1;
+  }
+  q->capacity = capacity;
+  for (int i = 0; i < capacity; i++) {
+    spmc_slot_at(q, i)->seq = i;
+  }
+  jq->impl = q;
+  return 0;
+}
+
+static void spmc_fini(struct job_queue *jq) {
+  struct spmc *q = jq->impl;
+  free(q->slots);
+  free(q);
+  jq->impl = NULL;
+}
+
+static int spmc_try_push(struct job_queue *jq, void *data) {
+  struct spmc *q = jq->impl;
+  size_t pos = q->enqueue_pos;
+  struct spmc_slot *s = spmc_slot_at(q, pos);
+  if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos) {
+    // Still holds data from the previous lap: full.
+    return 1;
+  }
+  jq_slot_put(jq, s->data, data);
+  __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&q->enqueue_pos, pos + 1, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+static int spmc_try_pop(struct job_queue *jq, void **data) {
+  struct spmc *q = jq->impl;
+  size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    struct spmc_slot *s = spmc_slot_at(q, pos);
+    size_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        jq_slot_get(jq, s->data, data);
+        __atomic_store_n(&s->seq, pos + q->capacity, __ATOMIC_RELEASE);
+        return 0;
+      }
+    } else if (diff < 0) {
+      return 1;
+    } else {
+      pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static int spmc_size(struct job_queue *jq) {
+  struct spmc *q = jq->impl;
+  size_t head = __atomic_load_n(&q->dequeue_pos, __ATOMIC_SEQ_CST);
+  size_t tail = __atomic_load_n(&q->enqueue_pos, __ATOMIC_SEQ_CST);
+  return tail > head ? (int)(tail - head) : 0;
+}
+
+struct jq_ops const jq_spmc_ops = {
+  .init      = spmc_init,
+  .fini      = spmc_fini,
+  .destroy   = jq_park_destroy,
+  .close     = jq_park_close,
+  .push_many = jq_park_push_many,
+  .pop_many  = jq_park_pop_many,
+  .try_push  = spmc_try_push,
+  .try_pop   = spmc_try_pop,
+  .size      = spmc_size,
+  .inline_values = 1,
+};
+
+// ---------- SPSC ----------
+
+// Each side's index and its cached copy of the other side's index.
+struct spsc_side {
+  size_t pos;
+  size_t other;
+  char   pad[CACHE_LINE - 2 * sizeof(size_t)];
+};
+
+struct spsc {
+  char            *slots;     // of 'size' bytes each
+  size_t           size;
+  size_t           capacity;
+  char             pad0[CACHE_LINE - sizeof(char *) - 2 * sizeof(size_t)];
+  struct spsc_side tail;    // producer
+  struct spsc_side head;    // consumer
+};
+
+static int spsc_init(struct job_queue *jq, int capacity,
+                     struct job_queue_attr const *attr) {
+  (void)attr;
+  void *mem;
+  if (posix_memalign(&mem, CACHE_LINE, sizeof(struct spsc)) != 0) {
+    return -1;
+  }
+  struct spsc *q = mem;
+  q->size = jq_slot_size(jq);
+  q->slots = malloc(q->size * capacity);
+  if (q->slots == NULL) {
+    free(q);
+    return -1;
+  }
+  q->capacity = capacity;
+  q->tail.pos = q->tail.other = 0;
+  q->head.pos = q->head.other = 0;
+  jq->impl = q;
+  return 0;
+}
+
+static void spsc_fini(struct job_queue *jq) {
+  struct spsc *q = jq->impl;
+  free(q->slots);
+  free(q);
+  jq->impl = NULL;
+}
+
+static int spsc_try_push(struct job_queue *jq, void *data) {
+  struct spsc *q = jq->impl;
+  size_t tail = q->tail.pos;
+  if (tail - q->tail.other == q->capacity) {
+    q->tail.other = __atomic_load_n(&q->head.pos, __ATOMIC_ACQUIRE);
+    if (tail - q->tail.other == q->capacity) {
+      return 1;
+    }
+  }
+  jq_slot_put(jq, q->slots + tail % q->capacity * q->size, data);
+  __atomic_store_n(&q->tail.pos, tail + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static int spsc_try_pop(struct job_queue *jq, void **data) {
+  struct spsc *q = jq->impl;
+  size_t head = q->head.pos;
+  if (head == q->head.other) {
+    q->head.other = __atomic_load_n(&q->tail.pos, __ATOMIC_ACQUIRE);
+    if (head == q->head.other) {
+      return 1;
+    }
+  }
+  jq_slot_get(jq, q->slots + head % q->capacity * q->size, data);
+  __atomic_store_n(&q->head.pos, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static int spsc_size(struct job_queue *jq) {
+  struct spsc *q = jq->impl;
+  size_t head = __atomic_load_n(&q->head.pos, __ATOMIC_SEQ_CST);
+  size_t tail = __atomic_load_n(&q->tail.pos, __ATOMIC_SEQ_CST);
+  return tail > head ? (int)(tail - head) : 0;
+}
+
+struct jq_ops const jq_spsc_ops = {
+  .init      = spsc_init,
+  .fini      = spsc_fini,
+  .destroy   = jq_park_destroy,
+  .close     = jq_park_close,
+  .push_many = jq_park_push_many,
+  .pop_many  = jq_park_pop_many,
+  .try_push  = spsc_try_push,
+  .try_pop   = spsc_try_pop,
+  .size      = spsc_size,
+  .inline_values = 1,
+};
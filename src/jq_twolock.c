@@ -0,0 +1,129 @@
+// Two-lock bounded ring buffer (JOB_QUEUE_TWOLOCK).
+//
+// As in Michael and Scott's two-lock queue, producers serialise on a
+// tail lock and consumers on a head lock, so a producer and a consumer
+// never wait for each other.  Each side keeps its lock, its index and
+// a cached copy of the other side's index on a cache line of its own.
+// A producer only reads the consumers' line when its cached head says
+// the ring is full, and vice versa, so a walker thread pushing paths
+// and workers popping them do not invalidate each other's lines on
+// every operation.
+//
+// Sleeping is left to the jq_park_*() functions, as for
+// JOB_QUEUE_LOCKFREE.  A queue of values keeps the elements themselves
+// in the slots.
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "job_queue.h"
+#include "jq_internal.h"
+
+#define CACHE_LINE 64
+
+// One side of the queue: the lock, the index that side advances, and
+// its last look at the other side's index.
+struct side {
+  pthread_mutex_t lock;
+  size_t          pos;
+  size_t          other;
+  char            pad[CACHE_LINE - (sizeof(pthread_mutex_t) + 2 * sizeof(size_t)) % CACHE_LINE];
+};
+
+struct twolock {
+  struct side  tail;    // producers
+  struct side  head;    // consumers
+  char        *slots;     // of jq_slot_size() bytes each
+  size_t       size;
+  size_t       capacity;
+};
+
+static int twolock_init(struct job_queue *jq, int capacity,
+                        struct job_queue_attr const *attr) {
+  (void)attr;
+  void *mem;
+  if (posix_memalign(&mem, CACHE_LINE, sizeof(struct twolock)) != 0) {
+    return -1;
+  }
+  struct twolock *tl = mem;
+  tl->size = jq_slot_size(jq);
+  tl->slots = malloc(tl->size * capacity);
+  if (tl->slots == NULL) {
+    free(tl);
+    return -1;
+  }
+  tl->capacity = capacity;
+  tl->tail.pos = tl->tail.other = 0;
+  tl->head.pos = tl->head.other = 0;
+  pthread_mutex_init(&tl->tail.lock, NULL);
+  pthread_mutex_init(&tl->head.lock, NULL);
+  jq->impl = tl;
+  return 0;
+}
+
+static void twolock_fini(struct job_queue *jq) {
+  struct twolock *tl = jq->impl;
+  pthread_mutex_destroy(&tl->tail.lock);
+  pthread_mutex_destroy(&tl->head.lock);
+  free(tl->slots);
+  free(tl);
+  jq->impl = NULL;
+}
+
+static int twolock_try_push(struct job_queue *jq, void *data) {
+  struct twolock *tl = jq->impl;
+  pthread_mutex_lock(&tl->tail.lock);
+  size_t tail = tl->tail.pos;
+  if (tail - tl->tail.other == tl->capacity) {
+    // Full as far as we know; see how far the consumers have got.
+    tl->tail.other = __atomic_load_n(&tl->head.pos, __ATOMIC_ACQUIRE);
+    if (tail - tl->tail.other == tl->capacity) {
+      pthread_mutex_unlock(&tl->tail.lock);
+      return 1;
+    }
+  }
+  jq_slot_put(jq, tl->slots + tail % tl->capacity * tl->size, data);
+  // Publish the element to the consumers.
+  __atomic_store_n(&tl->tail.pos, tail + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&tl->tail.lock);
+  return 0;
+}
+
+static int twolock_try_pop(struct job_queue *jq, void **data) {
+  struct twolock *tl = jq->impl;
+  pthread_mutex_lock(&tl->head.lock);
+  size_t head = tl->head.pos;
+  if (head == tl->head.other) {
+    // Empty as far as we know; see how far the producers have got.
+    tl->head.other = __atomic_load_n(&tl->tail.pos, __ATOMIC_ACQUIRE);
+    if (head == tl->head.other) {
+      pthread_mutex_unlock(&tl->head.lock);
+      return 1;
+    }
+  }
+  jq_slot_get(jq, tl->slots + head % tl->capacity * tl->size, data);
+  // Hand the slot back to the producers.
+  __atomic_store_n(&tl->head.pos, head + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&tl->head.lock);
+  return 0;
+}
+
+static int twolock_size(struct job_queue *jq) {
+  struct twolock *tl = jq->impl;
+  size_t head = __atomic_load_n(&tl->head.pos, __ATOMIC_SEQ_CST);
+  size_t tail = __atomic_load_n(&tl->tail.pos, __ATOMIC_SEQ_CST);
+  return tail > head ? (int)(tail - head) : 0;
+}
+
+struct jq_ops const jq_twolock_ops = {
+  .init      = twolock_init,
+  .fini      = twolock_fini,
+  .destroy   = jq_park_destroy,
+  .close     = jq_park_close,
+  .push_many = jq_park_push_many,
+  .pop_many  = jq_park_pop_many,
+  .try_push  = twolock_try_push,
+  .try_pop   = twolock_try_pop,
+  .size      = twolock_size,
+  .inline_values = 1,
+};
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "parallel.h"
+#include "future.h"
+
+// With grain 0, aim for at least this many chunks per participant at
+// the smallest chunk size
+#define AUTO_CHUNKS 16
+
+// Partial results are aligned as malloc() would align them
+#define ACC_ALIGN 16
+
+// Helper states.  A helper job that is still queued when the caller has
+// run out of chunks is cancelled, so that the caller never waits for a
+// job that has not started.
+#define HELPER_QUEUED    0
+#define HELPER_RUNNING   1
+#define HELPER_DONE      2
+#define HELPER_CANCELLED 3
+
+struct parallel;
+
+struct helper {
+  struct parallel *par;
+  int              state;
+  void            *acc;     // partial result
+};
+
+struct parallel {
+  long                next;     // the first index not yet handed out
+  long                end;
+  long                grain;
+  int                 parts;    // caller and helpers
+  parallel_for_fn     for_fn;
+  parallel_reduce_fn  reduce_fn;
+  void               *arg;
+  int                 refs;     // the caller and every queued helper
+  pthread_mutex_t     mutex;
+  pthread_cond_t      done;     // a helper finished
+  int                 nhelpers;
+  struct helper      *helpers;
+};
+
+// Take the next chunk.  Returns 0 once the range is used up.
+static int claim(struct parallel *par, long *begin, long *end) {
+  long next = __atomic_load_n(&par->next, __ATOMIC_RELAXED);
+  long stop;
+  do {
+    if (next >= par->end) {
+      return 0;
+    }
+    long take = (par->end - next) / (2 * par->parts);
+    if (take < par->grain) {
+      take = par->grain;
+    }
+    stop = par->end - next > take ? next + take : par->end;
+  } while (!__atomic_compare_exchange_n(&par->next, &next, stop, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  *begin = next;
+  *end = stop;
+  return 1;
+}
+
+// Run chunks until there are none left.
+static void work(struct parallel *par, void *acc) {
+  long begin, end;
+  while (claim(par, &begin, &end)) {
+    if (par->for_fn != NULL) {
+      par->for_fn(par->arg, begin, end);
+    } else {
+      par->reduce_fn(par->arg, begin, end, acc);
+    }
+  }
+}
+
+static void release(struct parallel *par) {
+  if (__atomic_sub_fetch(&par->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    assert(pthread_cond_destroy(&par->done) == 0);
+    assert(pthread_mutex_destroy(&par->mutex) == 0);
+    free(par);
+  }
+}
+
+static void helper_run(struct thread_pool_worker *worker, void *arg) {
+  (void)worker;
+  struct helper *helper = arg;
+  struct parallel *par = helper->par;
+  int state = HELPER_QUEUED;
+  if (__atomic_compare_exchange_n(&helper->state, &state, HELPER_RUNNING, 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    work(par, helper->acc);
+    assert(pthread_mutex_lock(&par->mutex) == 0);
+    __atomic_store_n(&helper->state, HELPER_DONE, __ATOMIC_RELEASE);
+    assert(pthread_cond_broadcast(&par->done) == 0);
+    assert(pthread_mutex_unlock(&par->mutex) == 0);
+  }
+  release(par);
+}
+
+// The common part of parallel_for() and parallel_reduce(); 'acc' is
+// NULL for the former.
+static int run(struct thread_pool *pool, long begin, long end, long grain,
+               parallel_for_fn for_fn, parallel_reduce_fn reduce_fn,
+               void *acc, size_t acc_size, parallel_combine_fn combine,
+               void *arg) {
+  if (pool->run != future_run || begin > end || grain < 0) {
+    return -1;
+  }
+  if (begin == end) {
+    return 0;
+  }
+  // Every worker but the caller may help
+  int nhelpers = __atomic_load_n(&pool->live, __ATOMIC_RELAXED);
+  struct thread_pool_worker *self = future_worker();
+  if (self != NULL && self->pool == pool) {
+    nhelpers--;
+  }
+  if (grain == 0) {
+    grain = (end - begin) / ((long)(nhelpers + 1) * AUTO_CHUNKS);
+    if (grain < 1) {
+      grain = 1;
+    }
+  }
+  if ((end - begin - 1) / grain < nhelpers) {
+    nhelpers = (end - begin - 1) / grain;
+  }
+
+  // One allocation for everything
+  size_t stride = (acc_size + ACC_ALIGN - 1) / ACC_ALIGN * ACC_ALIGN;
+  size_t accs_at = sizeof(struct parallel) + nhelpers * sizeof(struct helper);
+  accs_at = (accs_at + ACC_ALIGN - 1) / ACC_ALIGN * ACC_ALIGN;
+  struct parallel *par = malloc(accs_at + nhelpers * stride);
+  if (par == NULL) {
+    return -1;
+  }
+  par->next = begin;
+  par->end = end;
+  par->grain = grain;
+  par->parts = nhelpers + 1;
+  par->for_fn = for_fn;
+  par->reduce_fn = reduce_fn;
+  par->arg = arg;
+  par->refs = 1;
+  par->nhelpers = nhelpers;
+  par->helpers = (struct helper *)(par + 1);
+  char *accs = (char *)par + accs_at;
+  assert(pthread_mutex_init(&par->mutex, NULL) == 0);
+  assert(pthread_cond_init(&par->done, NULL) == 0);
+  for (int i = 0; i < nhelpers; i++) {
+    struct helper *helper = &par->helpers[i];
+    helper->par = par;
+    helper->state = HELPER_QUEUED;
+    helper->acc = NULL;
+    if (acc != NULL) {
+      helper->acc = accs + i * stride;
+      memcpy(helper->acc, acc, acc_size);
+    }
+    __atomic_add_fetch(&par->refs, 1, __ATOMIC_RELAXED);
+    if (future_spawn(pool, helper_run, helper) != 0) {
+      // Never runs; the caller does its share
+      helper->state = HELPER_CANCELLED;
+      __atomic_sub_fetch(&par->refs, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  work(par, acc);
+
+  // Cancel the helpers that have not started, and wait for the others
+  for (int i = 0; i < nhelpers; i++) {
+    struct helper *helper = &par->helpers[i];
+    int state = HELPER_QUEUED;
+    if (__atomic_compare_exchange_n(&helper->state, &state, HELPER_CANCELLED, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+        state == HELPER_CANCELLED) {
+      continue;
+    }
+    assert(pthread_mutex_lock(&par->mutex) == 0);
+    while (__atomic_load_n(&helper->state, __ATOMIC_ACQUIRE) != HELPER_DONE) {
+      assert(pthread_cond_wait(&par->done, &par->mutex) == 0);
+    }
+    assert(pthread_mutex_unlock(&par->mutex) == 0);
+    if (acc != NULL) {
+      combine(arg, acc, helper->acc);
+    }
+  }
+  release(par);
+  return 0;
+}
+
+int parallel_for(struct thread_pool *pool, long begin, long end, long grain,
+                 parallel_for_fn fn, void *arg) {
+  return run(pool, begin, end, grain, fn, NULL, NULL, 0, NULL, arg);
+}
+
+int parallel_reduce(struct thread_pool *pool, long begin, long end, long grain,
+                    void *result, size_t result_size,
+                    parallel_reduce_fn fn, parallel_combine_fn combine, void *arg) {
+  if (result == NULL || result_size == 0) {
+    return -1;
+  }
+  return run(pool, begin, end, grain, NULL, fn, result, result_size, combine, arg);
+}
@@ -0,0 +1,55 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+// Fork-join loops over an index range, run by a thread_pool.
+//
+// parallel_for() calls a function on disjoint chunks that together
+// cover [begin, end), on the calling thread and on helper jobs in the
+// pool, and returns once every chunk is done.  parallel_reduce() does
+// the same while each participant adds up a partial result, and then
+// combines the partial results.  This lets a tool split one big piece
+// of work (the blocks of a large file, say) over the pool rather than
+// leave it to a single worker.
+//
+// Chunks are handed out on demand, biggest first: every chunk is a
+// share of what is left, but no smaller than the grain, so that
+// participants that started late or got slow chunks still end at
+// about the same time.  A grain of 0 picks one from the size of the
+// range and the number of workers.
+//
+// Both can be called from any thread, including from inside a job of
+// the same pool, and nest: the caller works on the range itself and
+// only waits for helpers that have actually started, so a pool whose
+// workers are all inside parallel_for() cannot deadlock.  The pool must
+// be created with future_run() as its 'run' function (see future.h).
+
+#include <stddef.h>
+
+#include "thread_pool.h"
+
+// Handle the indices [begin, end).
+typedef void (*parallel_for_fn)(void *arg, long begin, long end);
+
+// Add the contribution of [begin, end) to the partial result 'acc'.
+typedef void (*parallel_reduce_fn)(void *arg, long begin, long end, void *acc);
+
+// Add the partial result 'other' to 'acc'.
+typedef void (*parallel_combine_fn)(void *arg, void *acc, void const *other);
+
+// Call 'fn' with 'arg' on chunks covering [begin, end), of at least
+// 'grain' indices each (except perhaps the last).  Returns non-zero on
+// error, in which case nothing has run.
+int parallel_for(struct thread_pool *pool, long begin, long end, long grain,
+                 parallel_for_fn fn, void *arg);
+
+// Like parallel_for(), with 'result_size' bytes of partial result per
+// participant.  '*result' must hold the identity of 'combine' on entry
+// (zeros, for a sum), which every partial result starts from, and
+// holds the total on return.  The order in which chunks land in
+// partial results varies, so 'combine' should be associative and
+// commutative.
+int parallel_reduce(struct thread_pool *pool, long begin, long end, long grain,
+                    void *result, size_t result_size,
+                    parallel_reduce_fn fn, parallel_combine_fn combine, void *arg);
+
+#endif
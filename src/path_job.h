@@ -0,0 +1,38 @@
+#ifndef PATH_JOB_H
+#define PATH_JOB_H
+
+// A file path as a thread_pool job value (see thread_pool_attr.job_size).
+// Paths that fit are kept in the job itself, so that walking a tree of
+// many small files needs no strdup() and free() per file; longer paths
+// fall back on a heap copy.
+
+#include <stdlib.h>
+#include <string.h>
+
+struct path_job {
+    char *heap;         // the path, if it did not fit in 'buf'
+    char  buf[248];     // sized so that a job is 256 bytes
+};
+
+// Returns non-zero if out of memory.
+static inline int path_job_set(struct path_job *job, char const *path) {
+    size_t len = strlen(path);
+    if (len < sizeof(job->buf)) {
+        memcpy(job->buf, path, len + 1);
+        job->heap = NULL;
+        return 0;
+    }
+    job->heap = strdup(path);
+    return job->heap == NULL ? -1 : 0;
+}
+
+static inline char const *path_job_path(struct path_job const *job) {
+    return job->heap != NULL ? job->heap : job->buf;
+}
+
+// Free what path_job_set() allocated, if anything.
+static inline void path_job_free(struct path_job *job) {
+    free(job->heap);
+}
+
+#endif
@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "reorder.h"
+
+int reorder_init(struct reorder *ro, int window, size_t result_size,
+                 reorder_emit_fn emit, void *arg) {
+  if (window < 1 || result_size == 0) {
+    return -1;
+  }
+  ro->ready = calloc(window, 1);
+  ro->results = malloc(window * result_size);
+  if (ro->ready == NULL || ro->results == NULL) {
+    free(ro->ready);
+    free(ro->results);
+    return -1;
+  }
+  ro->window = window;
+  ro->result_size = result_size;
+  ro->emit = emit;
+  ro->arg = arg;
+  ro->next_ticket = 0;
+  ro->next_emit = 0;
+  ro->emitting = 0;
+  assert(pthread_mutex_init(&ro->mutex, NULL) == 0);
+  assert(pthread_cond_init(&ro->cond, NULL) == 0);
+  return 0;
+}
+
+unsigned long reorder_ticket(struct reorder *ro) {
+  assert(pthread_mutex_lock(&ro->mutex) == 0);
+  while (ro->next_ticket - ro->next_emit >= (unsigned long)ro->window) {
+    assert(pthread_cond_wait(&ro->cond, &ro->mutex) == 0);
+  }
+  unsigned long ticket = ro->next_ticket++;
+  assert(pthread_mutex_unlock(&ro->mutex) == 0);
+  return ticket;
+}
+
+void reorder_done(struct reorder *ro, unsigned long ticket, void const *result) {
+  // The ticket was handed out at most 'window' tickets after
+  // 'next_emit', and 'next_emit' cannot pass it, so its slot is free
+  int slot = ticket % ro->window;
+  assert(pthread_mutex_lock(&ro->mutex) == 0);
+  memcpy(ro->results + slot * ro->result_size, result, ro->result_size);
+  ro->ready[slot] = 1;
+  if (ro->emitting) {
+    // The emitting thread will get to it
+    assert(pthread_mutex_unlock(&ro->mutex) == 0);
+    return;
+  }
+  // Emit everything that is due, without the lock, so that other
+  // workers can hand in results meanwhile.  No ticket that maps to the
+  // slot being emitted can be handed out until 'next_emit' moves on,
+  // so the result can be used in place.
+  ro->emitting = 1;
+  for (;;) {
+    slot = ro->next_emit % ro->window;
+    if (!ro->ready[slot]) {
+      break;
+    }
+    assert(pthread_mutex_unlock(&ro->mutex) == 0);
+    ro->emit(ro->results + slot * ro->result_size, ro->arg);
+    assert(pthread_mutex_lock(&ro->mutex) == 0);
+    ro->ready[slot] = 0;
+    ro->next_emit++;
+    assert(pthread_cond_broadcast(&ro->cond) == 0);
+  }
+  ro->emitting = 0;
+  assert(pthread_mutex_unlock(&ro->mutex) == 0);
+}
+
+int reorder_destroy(struct reorder *ro) {
+  assert(pthread_mutex_lock(&ro->mutex) == 0);
+  while (ro->next_emit != ro->next_ticket) {
+    assert(pthread_cond_wait(&ro->cond, &ro->mutex) == 0);
+  }
+  assert(pthread_mutex_unlock(&ro->mutex) == 0);
+  assert(pthread_cond_destroy(&ro->cond) == 0);
+  assert(pthread_mutex_destroy(&ro->mutex) == 0);
+  free(ro->ready);
+  free(ro->results);
+  return 0;
+}
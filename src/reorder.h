@@ -0,0 +1,67 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+// A reorder buffer, for putting the results of parallel jobs back in
+// the order the jobs were submitted.
+//
+// The producer takes a ticket for every job, in order, and hands it to
+// the job along with the work.  A worker that finishes a job passes
+// its result to reorder_done() with the ticket.  Results are emitted,
+// through a callback, strictly in ticket order: a result that arrives
+// early waits in the buffer until all earlier ones have been emitted.
+// The buffer holds at most 'window' results, so reorder_ticket()
+// blocks when the producer gets that far ahead of the oldest
+// unfinished job.  As long as every job that got a ticket is also
+// submitted, the oldest one is always on its way, so this cannot
+// deadlock.  A producer that submits in batches must keep the window
+// larger than a batch, or it may wait for a ticket that is still in
+// its own unsubmitted batch.
+//
+// Results are fixed-size values copied into the buffer, so that a
+// small result needs no allocation.  Emitting happens on whichever
+// thread completes the oldest outstanding ticket, one thread at a
+// time, without holding the buffer's lock.
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Called with each result in turn.  'result' points at the buffer's
+// copy of what was passed to reorder_done(), valid until the call
+// returns.
+typedef void (*reorder_emit_fn)(void *result, void *arg);
+
+struct reorder {
+    int             window;
+    size_t          result_size;
+    reorder_emit_fn emit;
+    void           *arg;
+    unsigned long   next_ticket;  // the next ticket to hand out
+    unsigned long   next_emit;    // the ticket whose result is due
+    int             emitting;     // a thread is calling 'emit'
+    char           *ready;        // per slot: result present
+    char           *results;      // window * result_size bytes
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;         // 'next_emit' advanced
+};
+
+// Initialise a reorder buffer for up to 'window' pending results of
+// 'result_size' bytes each, to be passed to 'emit' with 'arg'.
+// Returns non-zero on error.
+int reorder_init(struct reorder *ro, int window, size_t result_size,
+                 reorder_emit_fn emit, void *arg);
+
+// Take the next ticket.  Blocks while 'window' tickets are
+// outstanding.
+unsigned long reorder_ticket(struct reorder *ro);
+
+// Hand in the result for 'ticket', and emit every result that is now
+// due.  Every ticket must be handed in exactly once; a job that is
+// dropped or fails must still hand in a result (which 'emit' can tell
+// apart) or later results are never emitted.
+void reorder_done(struct reorder *ro, unsigned long ticket, void const *result);
+
+// Wait until every ticket handed out has been emitted, then free the
+// buffer.
+int reorder_destroy(struct reorder *ro);
+
+#endif
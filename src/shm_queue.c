@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm_queue.h"
+
+// Everything lives in the mapping, and nothing in it is a pointer.
+// 'head' and 'tail' count bytes ever popped and pushed, so 'tail -
+// head' bytes are in use, starting at ring[head % size].  Each element
+// is a uint32_t length followed by its bytes, both possibly wrapping
+// around the end of the ring.
+struct shm_queue {
+  pthread_mutex_t    mutex;
+  unsigned           pop_seq;   // futex words, see wait_on()
+  unsigned           push_seq;
+  int                pop_waiters;
+  int                push_waiters;
+  unsigned long long head;
+  unsigned long long tail;
+  size_t             size;      // of the ring
+  size_t             map_size;  // of the whole mapping
+  int                closed;
+  char               ring[];
+};
+
+typedef uint32_t elem_len;
+
+// ---------- Locking ----------
+
+// The mutex is robust: if its owner died, we get it anyway, and as
+// elements are only committed by moving 'head' or 'tail' after copying
+// them, there is nothing to repair.
+static int recover(struct shm_queue *q, int r) {
+  if (r == EOWNERDEAD) {
+    r = pthread_mutex_consistent(&q->mutex);
+  }
+  return r;
+}
+
+static void lock(struct shm_queue *q) {
+  assert(recover(q, pthread_mutex_lock(&q->mutex)) == 0);
+}
+
+static void unlock(struct shm_queue *q) {
+  assert(pthread_mutex_unlock(&q->mutex) == 0);
+}
+
+// Processes wait on futex words, 'pop_seq' for those that found the
+// queue empty and 'push_seq' for those that found it full, rather than
+// on process-shared condvars: a process killed while waiting on a
+// condvar can leave it so that signalling blocks forever.  A waiter
+// reads the word under the lock and sleeps until it changes; a change
+// to the queue bumps the word under the lock, so no wakeup is lost.  A
+// waiter that dies only leaves its count too high, which costs a
+// needless wake.  The futexes are shared, so not FUTEX_PRIVATE_FLAG.
+
+// Wait on '*seq' with the lock held, until 'deadline' if not NULL, or
+// spuriously.  Returns with the lock held, 1 if the deadline passed.
+static int wait_on(struct shm_queue *q, unsigned *seq, int *waiters,
+                   struct timespec const *deadline) {
+  unsigned seen = *seq;
+  (*waiters)++;
+  unlock(q);
+  // FUTEX_WAIT_BITSET takes an absolute deadline, as job_queue does
+  int r = syscall(SYS_futex, seq, FUTEX_WAIT_BITSET | FUTEX_CLOCK_REALTIME,
+                  seen, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+  int timed_out = r != 0 && errno == ETIMEDOUT;
+  lock(q);
+  (*waiters)--;
+  return timed_out;
+}
+
+// With the lock held, wake one or all of the waiters on '*seq'.
+static void wake(unsigned *seq, int waiters, int all) {
+  if (waiters > 0) {
+    (*seq)++;
+    syscall(SYS_futex, seq, FUTEX_WAKE, all ? INT_MAX : 1, NULL, NULL, 0);
+  }
+}
+
+// ---------- The ring ----------
+
+static void ring_write(struct shm_queue *q, unsigned long long at,
+                       void const *data, size_t len) {
+  size_t off = at % q->size;
+  size_t first = len < q->size - off ? len : q->size - off;
+  memcpy(q->ring + off, data, first);
+  memcpy(q->ring, (char const *)data + first, len - first);
+}
+
+static void ring_read(struct shm_queue *q, unsigned long long at,
+                      void *data, size_t len) {
+  size_t off = at % q->size;
+  size_t first = len < q->size - off ? len : q->size - off;
+  memcpy(data, q->ring + off, first);
+  memcpy((char *)data + first, q->ring, len - first);
+}
+
+// ---------- Setting up ----------
+
+static int init_mutex(struct shm_queue *q) {
+  pthread_mutexattr_t mattr;
+  if (pthread_mutexattr_init(&mattr) != 0) {
+    return -1;
+  }
+  int r = pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+  if (r == 0) {
+    r = pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+  }
+  if (r == 0) {
+    r = pthread_mutex_init(&q->mutex, &mattr);
+  }
+  pthread_mutexattr_destroy(&mattr);
+  return r == 0 ? 0 : -1;
+}
+
+struct shm_queue *shm_queue_create(char const *name, size_t size) {
+  if (size < 4 * sizeof(elem_len)) {
+    return NULL;
+  }
+  size_t map_size = sizeof(struct shm_queue) + size;
+  struct shm_queue *q;
+  if (name == NULL) {
+    q = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  } else {
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+      return NULL;
+    }
+    q = MAP_FAILED;
+    if (ftruncate(fd, map_size) == 0) {
+      q = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (q == MAP_FAILED) {
+      shm_unlink(name);
+    }
+  }
+  if (q == MAP_FAILED) {
+    return NULL;
+  }
+  // The mapping starts out zeroed
+  q->size = size;
+  q->map_size = map_size;
+  if (init_mutex(q) != 0) {
+    munmap(q, map_size);
+    if (name != NULL) {
+      shm_unlink(name);
+    }
+    return NULL;
+  }
+  return q;
+}
+
+struct shm_queue *shm_queue_open(char const *name) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  struct shm_queue *q = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(struct shm_queue)) {
+    q = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  return q == MAP_FAILED ? NULL : q;
+}
+
+size_t shm_queue_max_elem(struct shm_queue *q) {
+  return q->size / 4 - sizeof(elem_len);
+}
+
+int shm_queue_detach(struct shm_queue *q) {
+  return munmap(q, q->map_size);
+}
+
+int shm_queue_unlink(char const *name) {
+  return shm_unlink(name);
+}
+
+// ---------- Pushing and popping ----------
+
+int shm_queue_push_timed(struct shm_queue *q, void const *data, size_t len,
+                         struct timespec const *deadline) {
+  if (len > shm_queue_max_elem(q)) {
+    return -1;
+  }
+  size_t need = sizeof(elem_len) + len;
+  lock(q);
+  while (!q->closed && q->size - (q->tail - q->head) < need) {
+    if (wait_on(q, &q->push_seq, &q->push_waiters, deadline)) {
+      unlock(q);
+      return 1;
+    }
+  }
+  if (q->closed) {
+    unlock(q);
+    return -1;
+  }
+  elem_len n = len;
+  ring_write(q, q->tail, &n, sizeof(n));
+  ring_write(q, q->tail + sizeof(n), data, len);
+  q->tail += need;
+  wake(&q->pop_seq, q->pop_waiters, 0);
+  unlock(q);
+  return 0;
+}
+
+int shm_queue_push(struct shm_queue *q, void const *data, size_t len) {
+  return shm_queue_push_timed(q, data, len, NULL) == 0 ? 0 : -1;
+}
+
+ssize_t shm_queue_pop(struct shm_queue *q, void *buf, size_t cap) {
+  lock(q);
+  while (q->tail == q->head && !q->closed) {
+    wait_on(q, &q->pop_seq, &q->pop_waiters, NULL);
+  }
+  if (q->tail == q->head) {
+    unlock(q);
+    return -1;
+  }
+  elem_len n;
+  ring_read(q, q->head, &n, sizeof(n));
+  if (n > cap) {
+    unlock(q);
+    errno = EMSGSIZE;
+    return -1;
+  }
+  ring_read(q, q->head + sizeof(n), buf, n);
+  q->head += sizeof(n) + n;
+  // Elements vary in size, so the room may suit any of the pushers
+  wake(&q->push_seq, q->push_waiters, 1);
+  unlock(q);
+  return n;
+}
+
+int shm_queue_close(struct shm_queue *q) {
+  lock(q);
+  q->closed = 1;
+  wake(&q->pop_seq, q->pop_waiters, 1);
+  wake(&q->push_seq, q->push_waiters, 1);
+  unlock(q);
+  return 0;
+}
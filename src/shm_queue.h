@@ -0,0 +1,72 @@
+#ifndef SHM_QUEUE_H
+#define SHM_QUEUE_H
+
+// A bounded FIFO queue shared between processes, for workers that run
+// as separate processes rather than threads.
+//
+// A job_queue holds pointers, or values that may themselves point into
+// the pushing process, so it cannot be shared.  A shm_queue lives
+// entirely in one shared mapping: a byte ring holding each element as a
+// length followed by a copy of its bytes, a robust, process-shared
+// mutex, and futex words to wait on.  Elements are addressed by offsets
+// into the ring, so the mapping may sit at a different address in every
+// process, and elements vary in length, so a path costs only its own
+// bytes.
+//
+// A queue without a name is an anonymous shared mapping that children
+// inherit across fork().  A named one is a POSIX shared memory object
+// that unrelated processes attach to with shm_queue_open().
+//
+// A process that dies while holding the lock does not wedge the others:
+// the next one to lock takes over.  An element is added or removed only
+// once it has been copied, so the queue stays consistent, but the
+// element the dead process was popping is lost with it.
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct shm_queue;
+
+// Create a queue with a ring of 'size' bytes, anonymous if 'name' is
+// NULL.  Elements may be up to a quarter of 'size' long.  Returns NULL
+// on error, including if the name is taken.
+struct shm_queue *shm_queue_create(char const *name, size_t size);
+
+// Attach to the named queue created by another process.  Returns NULL
+// on error.
+struct shm_queue *shm_queue_open(char const *name);
+
+// The largest element the queue takes.
+size_t shm_queue_max_elem(struct shm_queue *q);
+
+// Push a copy of the 'len' bytes at 'data'.  Blocks while there is no
+// room.  Returns non-zero if the queue has been closed or the element
+// is too long.
+int shm_queue_push(struct shm_queue *q, void const *data, size_t len);
+
+// Like shm_queue_push(), but gives up at 'deadline', an absolute
+// CLOCK_REALTIME time.  Returns 0 on success, 1 if the deadline passed
+// first, and -1 on error.
+int shm_queue_push_timed(struct shm_queue *q, void const *data, size_t len,
+                         struct timespec const *deadline);
+
+// Pop an element into 'buf', which has room for 'cap' bytes.  Blocks
+// while the queue is empty.  Returns the length of the element, or -1
+// if the queue has been closed and is empty, or if the element does
+// not fit (errno EMSGSIZE; it stays queued).
+ssize_t shm_queue_pop(struct shm_queue *q, void *buf, size_t cap);
+
+// Refuse further pushes, and wake every process waiting to push or,
+// once the queue is empty, to pop.  Returns non-zero on error.
+int shm_queue_close(struct shm_queue *q);
+
+// Unmap the queue from this process.  The queue itself lives on while
+// other processes have it mapped, or, if named, until
+// shm_queue_unlink().
+int shm_queue_detach(struct shm_queue *q);
+
+// Remove the name of a named queue.
+int shm_queue_unlink(char const *name);
+
+#endif
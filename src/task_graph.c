@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include "task_graph.h"
+
+// The worker running the current thread's task, if any, so that tasks
+// submitted from inside a task go through thread_pool_spawn(), which
+// never blocks on a full queue.
+static __thread struct thread_pool_worker *current_worker;
+
+int task_graph_init(struct task_graph *graph, struct thread_pool *pool) {
+  if (pool->attr.job_size != 0) {
+    return -1;
+  }
+  graph->pool = pool;
+  graph->active = 0;
+  assert(pthread_mutex_init(&graph->mutex, NULL) == 0);
+  assert(pthread_cond_init(&graph->idle, NULL) == 0);
+  return 0;
+}
+
+struct task *task_create(struct task_graph *graph, task_fn fn, void *arg) {
+  struct task *task = malloc(sizeof(struct task));
+  if (task == NULL) {
+    return NULL;
+  }
+  task->graph = graph;
+  task->fn = fn;
+  task->arg = arg;
+  task->waiting = 1;
+  task->refs = 1;
+  task->submitted = 0;
+  task->done = 0;
+  task->succ = NULL;
+  task->nsucc = 0;
+  task->succ_cap = 0;
+  return task;
+}
+
+// Drop a reference to 'task', with the graph mutex held.
+static void unref(struct task *task) {
+  if (--task->refs == 0) {
+    free(task->succ);
+    free(task);
+  }
+}
+
+void task_release(struct task *task) {
+  struct task_graph *graph = task->graph;
+  assert(pthread_mutex_lock(&graph->mutex) == 0);
+  unref(task);
+  assert(pthread_mutex_unlock(&graph->mutex) == 0);
+}
+
+int task_depends(struct task *task, struct task *pred) {
+  struct task_graph *graph = task->graph;
+  int ret = 0;
+  assert(pthread_mutex_lock(&graph->mutex) == 0);
+  if (task->submitted || task == pred) {
+    ret = -1;
+  } else if (!pred->done) {
+    if (pred->nsucc == pred->succ_cap) {
+      int cap = pred->succ_cap > 0 ? pred->succ_cap * 2 : 4;
+      struct task **succ = realloc(pred->succ, sizeof(struct task *) * cap);
+      if (succ == NULL) {
+        assert(pthread_mutex_unlock(&graph->mutex) == 0);
+        return -1;
+      }
+      pred->succ = succ;
+      pred->succ_cap = cap;
+    }
+    pred->succ[pred->nsucc++] = task;
+    task->waiting++;
+  }
+  assert(pthread_mutex_unlock(&graph->mutex) == 0);
+  return ret;
+}
+
+// Hand a task whose predecessors have all finished to the pool.
+static int schedule(struct task *task) {
+  struct thread_pool *pool = task->graph->pool;
+  if (current_worker != NULL && current_worker->pool == pool) {
+    thread_pool_spawn(current_worker, task);
+    return 0;
+  }
+  return thread_pool_submit(pool, task);
+}
+
+int task_submit(struct task *task) {
+  struct task_graph *graph = task->graph;
+  assert(pthread_mutex_lock(&graph->mutex) == 0);
+  if (task->submitted) {
+    assert(pthread_mutex_unlock(&graph->mutex) == 0);
+    return -1;
+  }
+  task->submitted = 1;
+  task->refs++;   // released once the task has run
+  graph->active++;
+  int ready = --task->waiting == 0;
+  assert(pthread_mutex_unlock(&graph->mutex) == 0);
+  return ready ? schedule(task) : 0;
+}
+
+// Mark 'task' as finished and schedule the successors it was the last
+// predecessor of.
+static void complete(struct task *task) {
+  struct task_graph *graph = task->graph;
+  assert(pthread_mutex_lock(&graph->mutex) == 0);
+  task->done = 1;
+  // A successor is only scheduled once, by the last predecessor to
+  // finish, so the list can be walked after unlocking; nobody adds to
+  // it now that 'done' is set.
+  int n = 0;
+  for (int i = 0; i < task->nsucc; i++) {
+    if (--task->succ[i]->waiting == 0) {
+      task->succ[n++] = task->succ[i];
+    }
+  }
+  assert(pthread_mutex_unlock(&graph->mutex) == 0);
+  for (int i = 0; i < n; i++) {
+    schedule(task->succ[i]);
+  }
+  assert(pthread_mutex_lock(&graph->mutex) == 0);
+  if (--graph->active == 0) {
+    assert(pthread_cond_broadcast(&graph->idle) == 0);
+  }
+  unref(task);
+  assert(pthread_mutex_unlock(&graph->mutex) == 0);
+}
+
+void task_graph_run(struct thread_pool_worker *worker, void *job) {
+  struct task *task = job;
+  // A task may run inline inside another (see thread_pool_spawn())
+  struct thread_pool_worker *outer = current_worker;
+  current_worker = worker;
+  task->fn(worker, task->arg);
+  complete(task);
+  current_worker = outer;
+}
+
+int task_graph_wait(struct task_graph *graph) {
+  assert(pthread_mutex_lock(&graph->mutex) == 0);
+  while (graph->active > 0) {
+    assert(pthread_cond_wait(&graph->idle, &graph->mutex) == 0);
+  }
+  assert(pthread_mutex_unlock(&graph->mutex) == 0);
+  return 0;
+}
+
+int task_graph_destroy(struct task_graph *graph) {
+  task_graph_wait(graph);
+  assert(pthread_cond_destroy(&graph->idle) == 0);
+  assert(pthread_mutex_destroy(&graph->mutex) == 0);
+  return 0;
+}
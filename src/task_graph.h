@@ -0,0 +1,75 @@
+#ifndef TASK_GRAPH_H
+#define TASK_GRAPH_H
+
+// Tasks with dependencies, run by a thread_pool.
+//
+// A task is a function and an argument.  It may declare other tasks
+// as predecessors, and only runs once all of them have finished, so
+// that a pipeline such as "histogram every file, then sum up each
+// directory once its files and subdirectories are done" can proceed
+// directory by directory instead of in global phases.  Tasks can be
+// created and submitted at any time, also by running tasks, and a
+// predecessor may already be running or finished when the dependency
+// is declared.
+//
+// The pool must be created with task_graph_run() as its 'run'
+// function and without attr.job_size; its jobs are then tasks.
+
+#include <pthread.h>
+
+#include "thread_pool.h"
+
+typedef void (*task_fn)(struct thread_pool_worker *worker, void *arg);
+
+struct task_graph {
+    struct thread_pool *pool;
+    long                active;   // tasks submitted and not yet finished
+    pthread_mutex_t     mutex;    // protects every task's edges
+    pthread_cond_t      idle;     // 'active' dropped to 0
+};
+
+struct task {
+    struct task_graph *graph;
+    task_fn            fn;
+    void              *arg;
+    int                waiting;    // unfinished predecessors, +1 until submitted
+    int                refs;       // the caller's handle, and being scheduled
+    int                submitted;
+    int                done;
+    struct task      **succ;       // tasks waiting for this one
+    int                nsucc;
+    int                succ_cap;
+};
+
+// Initialise a graph whose tasks run on 'pool'.  Returns non-zero on
+// error, including if the pool passes jobs by value.
+int task_graph_init(struct task_graph *graph, struct thread_pool *pool);
+
+// The 'run' function for the pool.
+void task_graph_run(struct thread_pool_worker *worker, void *job);
+
+// Create a task that will call 'fn' with 'arg'.  The returned handle
+// stays valid until task_release().  Returns NULL if out of memory.
+struct task *task_create(struct task_graph *graph, task_fn fn, void *arg);
+
+// Make 'task' wait for 'pred' to finish.  Must be called before 'task'
+// is submitted.  Returns non-zero on error.
+int task_depends(struct task *task, struct task *pred);
+
+// Let 'task' run once its predecessors have finished.  Submitting a
+// task from inside another task never blocks.  Returns non-zero on
+// error.
+int task_submit(struct task *task);
+
+// Give up the handle from task_create().  The task itself carries on.
+void task_release(struct task *task);
+
+// Block until every submitted task has finished.  A task that waits
+// for a predecessor that is never submitted never finishes.
+int task_graph_wait(struct task_graph *graph);
+
+// Wait as for task_graph_wait(), then free the graph.  The pool is
+// left running.
+int task_graph_destroy(struct task_graph *graph);
+
+#endif
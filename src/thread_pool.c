@@ -0,0 +1,714 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+
+#include "thread_pool.h"
+
+// Upper bound on attr->batch, so that workers can keep a batch on
+// their stack.
+#define MAX_BATCH 64
+
+// An elastic pool looks at its backlog this often, and adds a worker
+// when jobs were backed up at two looks in a row
+#define GROW_DELAY_NS 5000000ULL
+
+void thread_pool_attr_init(struct thread_pool_attr *attr) {
+  job_queue_attr_init(&attr->queue);
+  attr->capacity = 64;
+  attr->work_stealing = 0;
+  attr->batch = 1;
+  attr->job_size = 0;
+  attr->arg = NULL;
+  attr->cpus = NULL;
+  attr->ncpus = 0;
+  attr->max_workers = 0;
+  attr->idle_ms = 100;
+  attr->completion_fd = 0;
+  attr->trace = NULL;
+  attr->worker_init = NULL;
+  attr->worker_idle = NULL;
+  attr->worker_fini = NULL;
+}
+
+// ---------- Job values ----------
+//
+// With attr.job_size, a job queue holds the job values themselves.
+// The work-stealing scheduler only deals in pointers, so there every
+// job value travels in a heap copy.
+//
+// With attr.trace, every queue element is a trace_stamp followed by
+// the job value, or by the job pointer, and attr.queue.elem_size is the
+// size of the whole.
+
+// When a job was submitted, and its weight
+struct trace_stamp {
+  unsigned long long queued_ns;
+  long long          weight;
+};
+
+static int traced(struct thread_pool *pool) {
+  return pool->attr.trace != NULL;
+}
+
+static int boxed_jobs(struct thread_pool *pool) {
+  return pool->attr.job_size > 0 && pool->attr.work_stealing;
+}
+
+static void *box_job(struct thread_pool *pool, void const *job) {
+  void *box = malloc(pool->attr.job_size);
+  if (box != NULL) {
+    memcpy(box, job, pool->attr.job_size);
+  }
+  return box;
+}
+
+// The job in a traced queue element, as handed to 'run'.
+static void *stamped_job(struct thread_pool *pool, void *elem) {
+  char *job = (char *)elem + sizeof(struct trace_stamp);
+  return pool->attr.job_size > 0 ? (void *)job : *(void **)job;
+}
+
+// Job 'i' of a batch from next_jobs(), as handed to 'run'.
+static void *batch_job(struct thread_pool *pool, void *jobs, int i) {
+  if (traced(pool)) {
+    return stamped_job(pool, (char *)jobs + i * pool->attr.queue.elem_size);
+  }
+  if (pool->attr.job_size > 0 && !pool->attr.work_stealing) {
+    return (char *)jobs + i * pool->attr.job_size;
+  }
+  return ((void **)jobs)[i];
+}
+
+static unsigned long long clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Traced queue elements for 'n' jobs as passed to
+// thread_pool_submit_many(), in a heap array.  Returns NULL if out of
+// memory.
+static void *stamp_jobs(struct thread_pool *pool, void const *jobs,
+                        long long const *weights, int n) {
+  size_t size = pool->attr.queue.elem_size;
+  size_t job_size = pool->attr.job_size > 0 ? pool->attr.job_size : sizeof(void *);
+  char *elems = malloc(n * size);
+  if (elems == NULL) {
+    return NULL;
+  }
+  unsigned long long now = clock_ns(CLOCK_MONOTONIC);
+  for (int i = 0; i < n; i++) {
+    struct trace_stamp stamp = { now, weights != NULL ? weights[i] : 0 };
+    memcpy(elems + i * size, &stamp, sizeof(stamp));
+    memcpy(elems + i * size + sizeof(stamp), (char const *)jobs + i * job_size, job_size);
+  }
+  return elems;
+}
+
+// ---------- Tracing ----------
+//
+// Workers collect the records of the jobs they run in a buffer of their
+// own, and write it to the trace under the pool's mutex whenever it
+// fills up and when they exit.
+
+#define TRACE_BUFFER 1024
+
+static void trace_flush(struct thread_pool_worker *worker) {
+  struct thread_pool *pool = worker->pool;
+  if (worker->ntrace == 0) {
+    return;
+  }
+  assert(pthread_mutex_lock(&pool->mutex) == 0);
+  fwrite(worker->trace, sizeof(struct job_trace_record), worker->ntrace, pool->attr.trace);
+  assert(pthread_mutex_unlock(&pool->mutex) == 0);
+  worker->ntrace = 0;
+}
+
+// Record a job that started at 'start' and has just finished.
+static void trace_job(struct thread_pool_worker *worker, struct trace_stamp const *stamp,
+                      unsigned long long start, unsigned flags) {
+  struct thread_pool *pool = worker->pool;
+  struct job_trace_record *r = &worker->trace[worker->ntrace++];
+  r->queued_ns = stamp->queued_ns - pool->trace_start;
+  r->started_ns = start - pool->trace_start;
+  r->ended_ns = clock_ns(CLOCK_MONOTONIC) - pool->trace_start;
+  r->bytes = stamp->weight;
+  r->worker = worker->id;
+  r->flags = flags;
+  if (worker->ntrace == TRACE_BUFFER) {
+    trace_flush(worker);
+  }
+}
+
+// ---------- Workers ----------
+
+// Count 'n' jobs as finished, waking thread_pool_wait() if that was
+// the last of them.
+static void finish_jobs(struct thread_pool *pool, long n) {
+  if (pool->done_fd >= 0) {
+    uint64_t count = n;
+    (void)!write(pool->done_fd, &count, sizeof(count));
+  }
+  if (__atomic_sub_fetch(&pool->pending, n, __ATOMIC_ACQ_REL) == 0) {
+    assert(pthread_mutex_lock(&pool->mutex) == 0);
+    assert(pthread_cond_broadcast(&pool->cond) == 0);
+    assert(pthread_mutex_unlock(&pool->mutex) == 0);
+  }
+}
+
+// Up to attr.batch jobs for 'worker', into 'jobs' (see batch_job()).
+// Returns how many, or -1 once the pool is shut down and drained.
+// Unless 'wait' is set, returns 0 rather than blocking when no job is
+// available right now.
+static int next_jobs(struct thread_pool_worker *worker, void *jobs, int wait) {
+  struct thread_pool *pool = worker->pool;
+  if (!pool->attr.work_stealing) {
+    if (wait) {
+      return job_queue_pop_values(&pool->jq, jobs, pool->attr.batch);
+    }
+    return job_queue_try_pop_values(&pool->jq, jobs, pool->attr.batch);
+  }
+  // The scheduler hands out one job at a time
+  if (wait) {
+    return ws_sched_pop(&pool->ws, worker->id, jobs) == 0 ? 1 : -1;
+  }
+  return ws_sched_try_pop(&pool->ws, worker->id, jobs) == 0 ? 1 : 0;
+}
+
+// Pin the calling worker to its CPU, if it has one.  Returns non-zero
+// on error.
+static int pin_worker(struct thread_pool_worker *worker) {
+  if (worker->cpu < 0) {
+    return 0;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(worker->cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// ---------- Elastic pool ----------
+
+static int elastic(struct thread_pool *pool) {
+  return pool->attr.max_workers > pool->nworkers;
+}
+
+// The calling thread's CPU time, and how often it has gone to sleep
+static void thread_usage(unsigned long long *cpu_ns, unsigned long long *sleeps) {
+  struct rusage ru;
+  getrusage(RUSAGE_THREAD, &ru);
+  *cpu_ns = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+            (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+  *sleeps = ru.ru_nvcsw;
+}
+
+// Wait for jobs as next_jobs() does.  In an elastic pool, a worker
+// that waits for attr.idle_ms in vain retires if there are more than
+// the minimum, and gets -1 as at shutdown.
+static int wait_jobs(struct thread_pool_worker *worker, void *jobs) {
+  struct thread_pool *pool = worker->pool;
+  if (!elastic(pool)) {
+    return next_jobs(worker, jobs, 1);
+  }
+  __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+  int n;
+  for (;;) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += pool->attr.idle_ms / 1000;
+    deadline.tv_nsec += (pool->attr.idle_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    n = job_queue_pop_values_timed(&pool->jq, jobs, pool->attr.batch, &deadline);
+    if (n != 0) {
+      break;
+    }
+    int live = __atomic_load_n(&pool->live, __ATOMIC_SEQ_CST);
+    if (live > pool->nworkers &&
+        __atomic_compare_exchange_n(&pool->live, &live, live - 1, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      n = -1;
+      break;
+    }
+  }
+  __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+  return n;
+}
+
+static void *worker_main(void *arg);
+
+// Start the worker in slot 'id'.  Returns non-zero on error.
+static int start_worker(struct thread_pool *pool, int id) {
+  struct thread_pool_worker *worker = &pool->workers[id];
+  worker->pool = pool;
+  worker->id = id;
+  worker->cpu = -1;
+  if (pool->attr.ncpus > 0) {
+    worker->cpu = pool->attr.cpus[id % pool->attr.ncpus];
+  }
+  worker->ctx = NULL;
+  worker->exited = 0;
+  worker->trace = NULL;
+  worker->ntrace = 0;
+  if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+    return -1;
+  }
+  worker->joinable = 1;
+  return 0;
+}
+
+// Add a worker to an elastic pool if jobs have stayed backed up with
+// every worker busy.  Called by submitters before they push, and by
+// workers after every batch, but decides at most once per
+// GROW_DELAY_NS.
+static void maybe_grow(struct thread_pool *pool) {
+  if (!elastic(pool) ||
+      __atomic_load_n(&pool->live, __ATOMIC_SEQ_CST) >= pool->attr.max_workers ||
+      __atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0) {
+    return;
+  }
+  unsigned long long now = clock_ns(CLOCK_MONOTONIC);
+  if (now - __atomic_load_n(&pool->checked_at, __ATOMIC_RELAXED) < GROW_DELAY_NS) {
+    return;
+  }
+  assert(pthread_mutex_lock(&pool->mutex) == 0);
+  // Once shutting down, the queue may be gone
+  if (pool->stopping || now - pool->checked_at < GROW_DELAY_NS) {
+    assert(pthread_mutex_unlock(&pool->mutex) == 0);
+    return;
+  }
+  __atomic_store_n(&pool->checked_at, now, __ATOMIC_RELAXED);
+  int live = __atomic_load_n(&pool->live, __ATOMIC_SEQ_CST);
+  int backlog = job_queue_size(&pool->jq) >= live * pool->attr.batch;
+  // Backed up at two checks in a row
+  int grow = backlog && pool->backlogged;
+  pool->backlogged = backlog;
+  if (grow && live >= pool->online_cpus) {
+    // Every CPU already has a worker: only worth it if the workers
+    // mostly wait rather than compute.  Time off the CPU may just be
+    // time spent preempted by the other workers, so they must also have
+    // gone to sleep, in at least every other batch.
+    unsigned long long busy = __atomic_load_n(&pool->busy_ns, __ATOMIC_RELAXED);
+    unsigned long long cpu = __atomic_load_n(&pool->cpu_ns, __ATOMIC_RELAXED);
+    unsigned long long sleeps = __atomic_load_n(&pool->sleeps, __ATOMIC_RELAXED);
+    unsigned long long batches = __atomic_load_n(&pool->batches, __ATOMIC_RELAXED);
+    grow = (cpu - pool->cpu_seen) * 2 < busy - pool->busy_seen &&
+           (sleeps - pool->sleeps_seen) * 2 >= batches - pool->batches_seen;
+    pool->busy_seen = busy;
+    pool->cpu_seen = cpu;
+    pool->sleeps_seen = sleeps;
+    pool->batches_seen = batches;
+  }
+  if (grow) {
+    // Reuse the slot of a worker that has retired, or a fresh one
+    for (int i = 0; i < pool->attr.max_workers; i++) {
+      struct thread_pool_worker *worker = &pool->workers[i];
+      if (worker->joinable) {
+        if (!__atomic_load_n(&worker->exited, __ATOMIC_ACQUIRE)) {
+          continue;
+        }
+        pthread_join(worker->thread, NULL);
+        worker->joinable = 0;
+      }
+      __atomic_add_fetch(&pool->live, 1, __ATOMIC_SEQ_CST);
+      if (start_worker(pool, i) != 0) {
+        __atomic_sub_fetch(&pool->live, 1, __ATOMIC_SEQ_CST);
+      } else if (live + 1 > pool->peak) {
+        pool->peak = live + 1;
+      }
+      break;
+    }
+    pool->backlogged = 0;
+  }
+  assert(pthread_mutex_unlock(&pool->mutex) == 0);
+}
+
+// ---------- Worker threads ----------
+
+static void *worker_main(void *arg) {
+  struct thread_pool_worker *worker = arg;
+  struct thread_pool *pool = worker->pool;
+
+  // Room for a batch of job pointers, or of queue elements
+  void *ptrs[MAX_BATCH];
+  void *jobs = ptrs;
+  if (pool->attr.queue.elem_size > 0 && !pool->attr.work_stealing) {
+    jobs = malloc(pool->attr.queue.elem_size * pool->attr.batch);
+  }
+  if (traced(pool)) {
+    worker->trace = malloc(TRACE_BUFFER * sizeof(struct job_trace_record));
+  }
+
+  // Set up, then wait for thread_pool_init() to say whether the pool
+  // as a whole got going
+  int ok = jobs != NULL && (worker->trace != NULL || !traced(pool)) &&
+           pin_worker(worker) == 0 &&
+           (pool->attr.worker_init == NULL || pool->attr.worker_init(worker) == 0);
+  assert(pthread_mutex_lock(&pool->mutex) == 0);
+  pool->started++;
+  if (!ok) {
+    pool->failed = 1;
+  }
+  assert(pthread_cond_broadcast(&pool->cond) == 0);
+  while (pool->go == 0) {
+    assert(pthread_cond_wait(&pool->cond, &pool->mutex) == 0);
+  }
+  int go = pool->go > 0;
+  assert(pthread_mutex_unlock(&pool->mutex) == 0);
+  if (go && !ok) {
+    // Added to an elastic pool that runs fine without it
+    __atomic_sub_fetch(&pool->live, 1, __ATOMIC_SEQ_CST);
+    go = 0;
+  }
+
+  while (go) {
+    int n = next_jobs(worker, jobs, 0);
+    if (n == 0) {
+      if (pool->attr.worker_idle != NULL) {
+        pool->attr.worker_idle(worker);
+      }
+      n = wait_jobs(worker, jobs);
+    }
+    if (n < 0) {
+      break;
+    }
+    // An elastic pool grows by how much of their time workers spend
+    // computing rather than blocked
+    unsigned long long busy = 0, cpu = 0, sleeps = 0;
+    if (elastic(pool)) {
+      busy = clock_ns(CLOCK_MONOTONIC);
+      thread_usage(&cpu, &sleeps);
+    }
+    for (int i = 0; i < n; i++) {
+      if (traced(pool)) {
+        struct trace_stamp stamp;
+        memcpy(&stamp, (char *)jobs + i * pool->attr.queue.elem_size, sizeof(stamp));
+        unsigned long long start = clock_ns(CLOCK_MONOTONIC);
+        pool->run(worker, batch_job(pool, jobs, i));
+        trace_job(worker, &stamp, start, 0);
+        continue;
+      }
+      pool->run(worker, batch_job(pool, jobs, i));
+      if (boxed_jobs(pool)) {
+        free(ptrs[i]);
+      }
+    }
+    if (elastic(pool)) {
+      unsigned long long cpu_end, sleeps_end;
+      thread_usage(&cpu_end, &sleeps_end);
+      __atomic_add_fetch(&pool->busy_ns, clock_ns(CLOCK_MONOTONIC) - busy, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&pool->cpu_ns, cpu_end - cpu, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&pool->sleeps, sleeps_end - sleeps, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&pool->batches, 1, __ATOMIC_RELAXED);
+    }
+    finish_jobs(pool, n);
+    if (!pool->attr.work_stealing) {
+      maybe_grow(pool);
+    }
+  }
+
+  if (ok && pool->attr.worker_fini != NULL) {
+    pool->attr.worker_fini(worker);
+  }
+  if (worker->trace != NULL) {
+    trace_flush(worker);
+    free(worker->trace);
+  }
+  if (jobs != ptrs) {
+    free(jobs);
+  }
+  __atomic_store_n(&worker->exited, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// Join the workers and free what the pool owns apart from the queue.
+static int join_workers(struct thread_pool *pool) {
+  int ret = 0;
+  int slots = pool->attr.max_workers > pool->nworkers ? pool->attr.max_workers : pool->nworkers;
+  for (int i = 0; i < slots; i++) {
+    if (pool->workers[i].joinable && pthread_join(pool->workers[i].thread, NULL) != 0) {
+      ret = -1;
+    }
+  }
+  free(pool->workers);
+  pool->workers = NULL;
+  if (pool->done_fd >= 0) {
+    close(pool->done_fd);
+    pool->done_fd = -1;
+  }
+  assert(pthread_cond_destroy(&pool->cond) == 0);
+  assert(pthread_mutex_destroy(&pool->mutex) == 0);
+  return ret;
+}
+
+// ---------- Public interface ----------
+
+int thread_pool_init(struct thread_pool *pool, int nworkers, thread_pool_fn run,
+                     struct thread_pool_attr const *attr) {
+  if (nworkers < 1) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (attr != NULL) {
+    pool->attr = *attr;
+  } else {
+    thread_pool_attr_init(&pool->attr);
+  }
+  // Every worker pops, so a single-consumer queue only works for one
+  if (!pool->attr.work_stealing && pool->attr.queue.kind == JOB_QUEUE_SPSC &&
+      (nworkers > 1 || pool->attr.max_workers > nworkers)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (pool->attr.work_stealing &&
+      (pool->attr.max_workers > nworkers || pool->attr.trace != NULL)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (traced(pool)) {
+    pool->attr.queue.elem_size = sizeof(struct trace_stamp) +
+      (pool->attr.job_size > 0 ? pool->attr.job_size : sizeof(void *));
+  } else if (!pool->attr.work_stealing) {
+    pool->attr.queue.elem_size = pool->attr.job_size;
+  }
+  if (pool->attr.batch < 1) {
+    pool->attr.batch = 1;
+  } else if (pool->attr.batch > MAX_BATCH) {
+    pool->attr.batch = MAX_BATCH;
+  }
+  pool->nworkers = nworkers;
+  pool->run = run;
+  pool->arg = pool->attr.arg;
+  pool->pending = 0;
+  pool->started = 0;
+  pool->failed = 0;
+  pool->go = 0;
+  pool->done_fd = -1;
+  if (pool->attr.completion_fd) {
+    pool->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->done_fd < 0) {
+      return -1;
+    }
+  }
+  pool->live = nworkers;
+  pool->idle = 0;
+  pool->peak = nworkers;
+  pool->online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  pool->busy_ns = 0;
+  pool->cpu_ns = 0;
+  pool->sleeps = 0;
+  pool->batches = 0;
+  pool->busy_seen = 0;
+  pool->cpu_seen = 0;
+  pool->sleeps_seen = 0;
+  pool->batches_seen = 0;
+  pool->checked_at = 0;
+  pool->backlogged = 0;
+  pool->stopping = 0;
+  pool->trace_start = clock_ns(CLOCK_MONOTONIC);
+  if (traced(pool)) {
+    struct job_trace_header header = {
+      .nworkers = nworkers,
+      .capacity = pool->attr.capacity,
+      .batch = pool->attr.batch,
+      .kind = pool->attr.queue.kind,
+    };
+    memcpy(header.magic, JOB_TRACE_MAGIC, sizeof(header.magic));
+    if (fwrite(&header, sizeof(header), 1, pool->attr.trace) != 1) {
+      if (pool->done_fd >= 0) {
+        close(pool->done_fd);
+      }
+      return -1;
+    }
+  }
+  int slots = pool->attr.max_workers > nworkers ? pool->attr.max_workers : nworkers;
+  pool->workers = calloc(slots, sizeof(struct thread_pool_worker));
+  if (pool->workers == NULL) {
+    if (pool->done_fd >= 0) {
+      close(pool->done_fd);
+    }
+    return -1;
+  }
+  assert(pthread_mutex_init(&pool->mutex, NULL) == 0);
+  assert(pthread_cond_init(&pool->cond, NULL) == 0);
+
+  // Start the workers and wait until they have set themselves up.
+  // The queue comes last: a work-stealing scheduler must see all of
+  // its workers, so it is only created once they all exist.
+  int created = 0;
+  while (created < nworkers && start_worker(pool, created) == 0) {
+    created++;
+  }
+  assert(pthread_mutex_lock(&pool->mutex) == 0);
+  while (pool->started < created) {
+    assert(pthread_cond_wait(&pool->cond, &pool->mutex) == 0);
+  }
+  int failed = pool->failed || created < nworkers;
+  assert(pthread_mutex_unlock(&pool->mutex) == 0);
+  if (!failed) {
+    if (pool->attr.work_stealing) {
+      failed = ws_sched_init(&pool->ws, nworkers, pool->attr.capacity) != 0;
+    } else {
+      failed = job_queue_init_attr(&pool->jq, pool->attr.capacity,
+                                   &pool->attr.queue) != 0;
+    }
+  }
+
+  // Let the workers go, or tell them to give up
+  assert(pthread_mutex_lock(&pool->mutex) == 0);
+  pool->go = failed ? -1 : 1;
+  assert(pthread_cond_broadcast(&pool->cond) == 0);
+  assert(pthread_mutex_unlock(&pool->mutex) == 0);
+  if (failed) {
+    join_workers(pool);
+    return -1;
+  }
+  return 0;
+}
+
+int thread_pool_submit(struct thread_pool *pool, void *job) {
+  void const *jobs = pool->attr.job_size > 0 ? job : (void const *)&job;
+  return thread_pool_submit_many(pool, jobs, NULL, 1) == 1 ? 0 : -1;
+}
+
+int thread_pool_submit_many(struct thread_pool *pool, void const *jobs,
+                            long long const *weights, int n) {
+  if (n <= 0) {
+    return 0;
+  }
+  // Count the jobs before any worker can finish them
+  __atomic_add_fetch(&pool->pending, n, __ATOMIC_ACQ_REL);
+  int accepted;
+  if (traced(pool)) {
+    maybe_grow(pool);
+    void *elems = stamp_jobs(pool, jobs, weights, n);
+    accepted = elems != NULL ? job_queue_push_values(&pool->jq, elems, weights, n) : 0;
+    free(elems);
+  } else if (!pool->attr.work_stealing) {
+    maybe_grow(pool);
+    accepted = job_queue_push_values(&pool->jq, jobs, weights, n);
+  } else {
+    accepted = 0;
+    while (accepted < n) {
+      void *job = ((void *const *)jobs)[accepted];
+      if (boxed_jobs(pool)) {
+        job = box_job(pool, (char const *)jobs + accepted * pool->attr.job_size);
+        if (job == NULL) {
+          break;
+        }
+      }
+      if (ws_sched_submit(&pool->ws, job) != 0) {
+        if (boxed_jobs(pool)) {
+          free(job);
+        }
+        break;
+      }
+      accepted++;
+    }
+  }
+  if (accepted < n) {
+    finish_jobs(pool, n - accepted);
+  }
+  return accepted;
+}
+
+void thread_pool_spawn(struct thread_pool_worker *worker, void *job) {
+  struct thread_pool *pool = worker->pool;
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+  int queued;
+  if (pool->attr.work_stealing) {
+    void *box = boxed_jobs(pool) ? box_job(pool, job) : job;
+    queued = box != NULL && ws_sched_push(&pool->ws, worker->id, box) == 0;
+    if (!queued && box != job) {
+      free(box);
+    }
+  } else if (pool->attr.queue.kind == JOB_QUEUE_SPMC ||
+             pool->attr.queue.kind == JOB_QUEUE_SPSC) {
+    queued = 0;
+  } else if (traced(pool)) {
+    void *elem = stamp_jobs(pool, pool->attr.job_size > 0 ? job : &job, NULL, 1);
+    queued = elem != NULL && job_queue_try_push_value(&pool->jq, elem) == 0;
+    free(elem);
+  } else {
+    queued = job_queue_try_push_value(&pool->jq, pool->attr.job_size > 0 ? job : &job) == 0;
+  }
+  if (!queued) {
+    unsigned long long start = traced(pool) ? clock_ns(CLOCK_MONOTONIC) : 0;
+    pool->run(worker, job);
+    if (traced(pool)) {
+      struct trace_stamp stamp = { start, 0 };
+      trace_job(worker, &stamp, start, JOB_TRACE_NESTED);
+    }
+    finish_jobs(pool, 1);
+  }
+}
+
+int thread_pool_wait(struct thread_pool *pool) {
+  assert(pthread_mutex_lock(&pool->mutex) == 0);
+  while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0) {
+    assert(pthread_cond_wait(&pool->cond, &pool->mutex) == 0);
+  }
+  assert(pthread_mutex_unlock(&pool->mutex) == 0);
+  return 0;
+}
+
+int thread_pool_shutdown(struct thread_pool *pool) {
+  // From now on the pool stays the size it is
+  assert(pthread_mutex_lock(&pool->mutex) == 0);
+  pool->stopping = 1;
+  assert(pthread_mutex_unlock(&pool->mutex) == 0);
+  // Destroying the queue drains it and makes the workers' next pop fail
+  if (pool->attr.work_stealing) {
+    ws_sched_destroy(&pool->ws);
+  } else {
+    job_queue_destroy(&pool->jq);
+  }
+  return join_workers(pool);
+}
+
+// job_queue_cancel() takes no argument for its callback, so with
+// attr.trace the pool and the caller's 'discard' are passed this way
+static __thread struct thread_pool *cancel_pool;
+static __thread void (*cancel_discard)(void *job);
+
+static void discard_stamped(void *elem) {
+  cancel_discard(stamped_job(cancel_pool, elem));
+}
+
+int thread_pool_cancel(struct thread_pool *pool, void (*discard)(void *job)) {
+  if (pool->attr.work_stealing) {
+    return -1;
+  }
+  if (traced(pool) && discard != NULL) {
+    cancel_pool = pool;
+    cancel_discard = discard;
+    discard = discard_stamped;
+  }
+  int n = job_queue_cancel(&pool->jq, discard);
+  if (n > 0) {
+    finish_jobs(pool, n);
+  }
+  return 0;
+}
+
+int thread_pool_completion_fd(struct thread_pool *pool) {
+  return pool->done_fd;
+}
+
+int thread_pool_stats(struct thread_pool *pool, struct job_queue_stats *stats) {
+  if (pool->attr.work_stealing) {
+    return -1;
+  }
+  return job_queue_stats(&pool->jq, stats);
+}
@@ -0,0 +1,192 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// A fixed set of worker threads running jobs from a job_queue, or
+// optionally from a work-stealing scheduler.
+//
+// The pool owns the threads and the queue, so programs only say what a
+// job is and, through the per-worker hooks, what state each worker
+// keeps (output buffers, partial results, ...).  A job is an opaque
+// pointer handed to the 'run' function given at initialisation, or,
+// with thread_pool_attr.job_size, a small fixed-size value that the
+// pool copies through its queue so that nobody has to allocate it.
+
+#include <pthread.h>
+
+#include "job_queue.h"
+#include "job_trace.h"
+#include "work_steal.h"
+
+struct thread_pool;
+
+// What a worker knows about itself.  Passed to every hook and job.
+struct thread_pool_worker {
+    struct thread_pool *pool;
+    int                 id;     // 0 .. nworkers - 1
+    int                 cpu;    // the CPU it is pinned to, or -1
+    void               *ctx;    // per-worker state, set by worker_init
+    pthread_t           thread;
+    int                 joinable;   // 'thread' has been started and not joined
+    int                 exited;     // the thread is done with this slot
+    struct job_trace_record *trace; // records not yet written, with attr.trace
+    int                 ntrace;
+};
+
+// Run one job.
+typedef void (*thread_pool_fn)(struct thread_pool_worker *worker, void *job);
+
+// Options for thread_pool_init().  Always set up with
+// thread_pool_attr_init() before changing individual fields.
+struct thread_pool_attr {
+    struct job_queue_attr queue;    // queue kind and options
+    int                   capacity; // queue capacity (per worker with work_stealing)
+    int                   work_stealing;
+    int                   batch;    // jobs taken from the queue at a time
+    // If non-zero, jobs are values of this many bytes rather than
+    // pointers: submitting a job means passing a pointer to it, which
+    // the pool copies (into the queue itself with every kind that
+    // stores values inline, see job_queue_attr.elem_size), and 'run'
+    // and 'discard' get a pointer to a copy that is valid until they
+    // return.
+    size_t                job_size;
+    void                 *arg;      // shared by all workers, as pool->arg
+    // If 'ncpus' is non-zero, worker i is pinned to CPU cpus[i %
+    // ncpus], so that it keeps its caches warm rather than floating
+    // between cores.  See cpu_pin_parse() in topology.h for building
+    // the list.  The array must stay valid until thread_pool_init()
+    // returns.
+    int const            *cpus;
+    int                   ncpus;
+    // If larger than the number of workers passed to
+    // thread_pool_init(), the pool is elastic: it starts that many
+    // workers and adds more, up to this number, while jobs back up in
+    // the queue and no worker is idle.  Beyond one worker per CPU it
+    // only adds workers if they spend most of their time blocked (in
+    // I/O, say) rather than computing.  A worker that has found no job
+    // for 'idle_ms' milliseconds exits, unless only the initial number
+    // are left.  Not supported with work stealing or JOB_QUEUE_SPSC.
+    int                   max_workers;
+    int                   idle_ms;
+    // Create an eventfd that counts finished jobs, for an event loop
+    // to wait on (see thread_pool_completion_fd()).  Off by default.
+    int                   completion_fd;
+    // If not NULL, record when every job was submitted, started and
+    // finished, to this stream in the format of job_trace.h.  The pool
+    // writes as it goes and has written everything once
+    // thread_pool_shutdown() returns, but does not close the stream.
+    // Not supported with work stealing.
+    FILE                 *trace;
+
+    // Optional hooks, all called on the worker thread.  worker_init
+    // runs before the worker takes any job and may set worker->ctx; a
+    // non-zero return makes thread_pool_init() fail.  worker_idle runs
+    // whenever the worker is about to wait for work, and worker_fini
+    // after its last job (only if worker_init succeeded).
+    int  (*worker_init)(struct thread_pool_worker *worker);
+    void (*worker_idle)(struct thread_pool_worker *worker);
+    void (*worker_fini)(struct thread_pool_worker *worker);
+};
+
+struct thread_pool {
+    int                        nworkers;  // the minimum, with attr.max_workers
+    struct thread_pool_worker *workers;   // room for the maximum
+    int                        live;      // workers running
+    int                        idle;      // workers waiting for a job
+    int                        peak;      // most workers running at once
+    int                        online_cpus;
+    unsigned long long         busy_ns;   // time workers spent running jobs,
+    unsigned long long         cpu_ns;    // how much of it on a CPU,
+    unsigned long long         sleeps;    // how often they went to sleep,
+    unsigned long long         batches;   // in how many batches of jobs
+    unsigned long long         busy_seen; // the above at the last growth
+    unsigned long long         cpu_seen;  // decision
+    unsigned long long         sleeps_seen;
+    unsigned long long         batches_seen;
+    unsigned long long         checked_at; // the last look at the backlog
+    int                        backlogged; // jobs were backed up then
+    int                        stopping;   // shutting down; do not grow
+    thread_pool_fn             run;
+    struct thread_pool_attr    attr;
+    void                      *arg;
+    struct job_queue           jq;
+    struct ws_sched            ws;
+    long                       pending;   // submitted jobs not yet finished
+    int                        done_fd;   // eventfd from attr.completion_fd, or -1
+    unsigned long long         trace_start; // time 0 of attr.trace
+    int                        started;   // workers past worker_init
+    int                        failed;    // some worker_init failed
+    int                        go;        // 1 to run jobs, -1 to give up
+    pthread_mutex_t            mutex;
+    pthread_cond_t             cond;      // 'pending' or 'started' changed
+};
+
+// Fill in the default attributes: a queue from job_queue_attr_init()
+// with capacity 64, one job at a time, no hooks, a fixed number of
+// workers.
+void thread_pool_attr_init(struct thread_pool_attr *attr);
+
+// Start 'nworkers' threads that run jobs with 'run'.  Passing NULL for
+// 'attr' is the same as passing the defaults.  Returns once every
+// worker has run worker_init, or non-zero on error, in which case the
+// workers that did start have been stopped again.  A JOB_QUEUE_SPSC
+// queue is an error with more than one worker, and so is failing to
+// pin a worker to its CPU.  Attributes that do not go together fail
+// with errno EINVAL.  With attr.max_workers, 'nworkers' is the
+// minimum.
+int thread_pool_init(struct thread_pool *pool, int nworkers, thread_pool_fn run,
+                     struct thread_pool_attr const *attr);
+
+// Submit a job from any thread.  Blocks while the queue is full.
+// With attr.job_size, 'job' points at the job value to copy.  Returns
+// non-zero on error, including after thread_pool_shutdown().
+int thread_pool_submit(struct thread_pool *pool, void *job);
+
+// Submit 'n' jobs at once, with a weight for each (or NULL) as for
+// job_queue_push_many_weighted().  'jobs' is an array of 'n' pointers,
+// or of 'n' values with attr.job_size.  Returns how many were accepted.
+int thread_pool_submit_many(struct thread_pool *pool, void const *jobs,
+                            long long const *weights, int n);
+
+// Submit a job from inside a running job.  With work stealing the job
+// goes to the calling worker's own deque.  Otherwise it is queued if
+// there is room, and run at once by the caller if not, so that workers
+// can never all block on a full queue.  With a single-producer queue
+// kind, the job always runs at once, since workers must not push.
+void thread_pool_spawn(struct thread_pool_worker *worker, void *job);
+
+// Block until every job submitted so far, and every job they spawned,
+// has finished.
+int thread_pool_wait(struct thread_pool *pool);
+
+// Let the workers finish all remaining jobs, then stop them and free
+// the pool.
+int thread_pool_shutdown(struct thread_pool *pool);
+
+// Give up on the jobs still queued, for instance once a job has found
+// what the program was looking for.  Further submissions fail, and
+// each queued job is handed to 'discard' (unless NULL) instead of
+// being run.  Jobs already running finish normally.  May be called from
+// any thread, including from inside a job, and any number of times;
+// the pool must still be shut down with thread_pool_shutdown().  With
+// JOB_QUEUE_SPSC, though, the caller pops the queue alongside the one
+// worker, so call it only from inside a job (see job_queue_cancel()).
+// Not supported with work stealing, where it returns non-zero and jobs
+// have to notice for themselves that they are no longer wanted.
+int thread_pool_cancel(struct thread_pool *pool, void (*discard)(void *job));
+
+// The eventfd of a pool created with attr.completion_fd, or -1.
+// Reading it returns the number of jobs finished since the last read,
+// counting discarded and rejected ones, and it is readable while that
+// is non-zero.  Workers add to it once per batch of jobs.  The pool
+// closes it in thread_pool_shutdown().  To hear from the queue side as
+// well, set attr.queue.ready_fd and use job_queue_ready_fd() on
+// pool->jq.
+int thread_pool_completion_fd(struct thread_pool *pool);
+
+// Statistics of the pool's job queue (see job_queue_stats()), if
+// attr.queue.stats was set.  May be called after
+// thread_pool_shutdown().  Returns non-zero if there are none, which is
+// always the case with work stealing.
+int thread_pool_stats(struct thread_pool *pool, struct job_queue_stats *stats);
+
+#endif
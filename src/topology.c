@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "topology.h"
+
+// Read a number from a sysfs file.  Returns -1 if there is none.
+static int read_sysfs(int cpu, char const *name) {
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  int value;
+  if (fscanf(f, "%d", &value) != 1) {
+    value = -1;
+  }
+  fclose(f);
+  return value;
+}
+
+static int cmp_compact(void const *a, void const *b) {
+  struct cpu_info const *x = a;
+  struct cpu_info const *y = b;
+  if (x->package != y->package) {
+    return x->package - y->package;
+  }
+  if (x->core != y->core) {
+    return x->core - y->core;
+  }
+  return x->cpu - y->cpu;
+}
+
+int cpu_topology_init(struct cpu_topology *topo) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return -1;
+  }
+  topo->ncpus = CPU_COUNT(&allowed);
+  topo->ncores = 0;
+  topo->cpus = malloc(sizeof(struct cpu_info) * topo->ncpus);
+  if (topo->cpus == NULL) {
+    return -1;
+  }
+  int n = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE && n < topo->ncpus; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed)) {
+      continue;
+    }
+    struct cpu_info *info = &topo->cpus[n++];
+    info->cpu = cpu;
+    info->package = read_sysfs(cpu, "physical_package_id");
+    info->core = read_sysfs(cpu, "core_id");
+    if (info->package < 0 || info->core < 0) {
+      // No topology: a core of its own
+      info->package = 0;
+      info->core = cpu;
+    }
+  }
+  // Siblings are now adjacent, and numbered in order
+  qsort(topo->cpus, n, sizeof(struct cpu_info), cmp_compact);
+  for (int i = 0; i < n; i++) {
+    struct cpu_info *info = &topo->cpus[i];
+    if (i > 0 && info->package == info[-1].package && info->core == info[-1].core) {
+      info->thread = info[-1].thread + 1;
+    } else {
+      info->thread = 0;
+      topo->ncores++;
+    }
+  }
+  return 0;
+}
+
+void cpu_topology_destroy(struct cpu_topology *topo) {
+  free(topo->cpus);
+  topo->cpus = NULL;
+}
+
+// For scatter order: sibling index first, then the core's position
+// within its package, so that consecutive CPUs alternate packages.
+struct scatter_key {
+  int thread;
+  int rank;
+  int package;
+  int cpu;
+};
+
+static int cmp_scatter(void const *a, void const *b) {
+  struct scatter_key const *x = a;
+  struct scatter_key const *y = b;
+  if (x->thread != y->thread) {
+    return x->thread - y->thread;
+  }
+  if (x->rank != y->rank) {
+    return x->rank - y->rank;
+  }
+  if (x->package != y->package) {
+    return x->package - y->package;
+  }
+  return x->cpu - y->cpu;
+}
+
+void cpu_topology_order(struct cpu_topology const *topo,
+                        enum cpu_placement placement, int *cpus) {
+  int n = topo->ncpus;
+  if (placement == CPU_PLACE_COMPACT) {
+    for (int i = 0; i < n; i++) {
+      cpus[i] = topo->cpus[i].cpu;
+    }
+    return;
+  }
+  struct scatter_key keys[n];
+  int rank = -1;
+  for (int i = 0; i < n; i++) {
+    struct cpu_info const *info = &topo->cpus[i];
+    if (i == 0 || info->package != info[-1].package) {
+      rank = 0;
+    } else if (info->thread == 0) {
+      rank++;
+    }
+    keys[i] = (struct scatter_key){ info->thread, rank, info->package, info->cpu };
+  }
+  qsort(keys, n, sizeof(struct scatter_key), cmp_scatter);
+  for (int i = 0; i < n; i++) {
+    cpus[i] = keys[i].cpu;
+  }
+}
+
+// Parse a list such as "0,2,4-7" into 'cpus', which has room for
+// CPU_SETSIZE entries.  Returns the count, or -1.
+static int parse_list(char const *spec, int *cpus) {
+  int n = 0;
+  char const *p = spec;
+  for (;;) {
+    char *end;
+    long first = strtol(p, &end, 10);
+    if (end == p || first < 0 || first >= CPU_SETSIZE) {
+      return -1;
+    }
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      p++;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first || last >= CPU_SETSIZE) {
+        return -1;
+      }
+      p = end;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      if (n == CPU_SETSIZE) {
+        return -1;
+      }
+      cpus[n++] = cpu;
+    }
+    if (*p == '\0') {
+      return n;
+    }
+    if (*p++ != ',') {
+      return -1;
+    }
+  }
+}
+
+int cpu_pin_parse(char const *spec, int **cpus) {
+  int compact = strcmp(spec, "compact") == 0;
+  int scatter = strcmp(spec, "scatter") == 0;
+  if (!compact && !scatter) {
+    *cpus = malloc(sizeof(int) * CPU_SETSIZE);
+    if (*cpus == NULL) {
+      return -1;
+    }
+    int n = parse_list(spec, *cpus);
+    if (n < 0) {
+      free(*cpus);
+      *cpus = NULL;
+    }
+    return n;
+  }
+  struct cpu_topology topo;
+  if (cpu_topology_init(&topo) != 0) {
+    return -1;
+  }
+  *cpus = malloc(sizeof(int) * topo.ncpus);
+  int n = topo.ncpus;
+  if (*cpus == NULL) {
+    n = -1;
+  } else {
+    cpu_topology_order(&topo, compact ? CPU_PLACE_COMPACT : CPU_PLACE_SCATTER, *cpus);
+  }
+  cpu_topology_destroy(&topo);
+  return n;
+}
@@ -0,0 +1,53 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+// CPU topology, for placing worker threads (see
+// thread_pool_attr.cpus).
+//
+// Hyperthreads (SMT siblings) of one physical core share its L1 and L2
+// caches and execution units.  Packing workers onto siblings keeps
+// data they share close; spreading them over physical cores first
+// gives each one a core's worth of cache and compute.  Compute-heavy
+// workers want the latter, while workers that mostly wait for I/O can
+// share a core with them.
+
+struct cpu_info {
+    int cpu;        // number as for sched_setaffinity()
+    int package;    // physical package (socket)
+    int core;       // core id, unique within the package
+    int thread;     // index among the core's SMT siblings, 0 for the first
+};
+
+struct cpu_topology {
+    int              ncpus;     // CPUs this process may run on
+    int              ncores;    // physical cores among them
+    struct cpu_info *cpus;      // ordered by package, core and thread
+};
+
+// How to order CPUs for placing workers.
+enum cpu_placement {
+    CPU_PLACE_COMPACT,  // fill each core's siblings, then the next core
+    CPU_PLACE_SCATTER,  // one CPU per physical core, across packages,
+                        // before any second sibling
+};
+
+// Find the CPUs the calling thread may run on and how they share
+// cores, from /sys/devices/system/cpu.  Where that is unavailable,
+// every CPU counts as a core of its own.  Returns non-zero on error.
+int cpu_topology_init(struct cpu_topology *topo);
+
+void cpu_topology_destroy(struct cpu_topology *topo);
+
+// Write the topo->ncpus CPU numbers to 'cpus' in the order given by
+// 'placement'.
+void cpu_topology_order(struct cpu_topology const *topo,
+                        enum cpu_placement placement, int *cpus);
+
+// Parse a pinning specification: "compact", "scatter", or a list of
+// CPU numbers and ranges such as "0,2,4-7".  On success stores a
+// malloc()ed array of CPU numbers in '*cpus', for
+// thread_pool_attr.cpus, and returns its length.  Returns -1 if the
+// specification is malformed or the topology cannot be read.
+int cpu_pin_parse(char const *spec, int **cpus);
+
+#endif
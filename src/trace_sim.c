@@ -0,0 +1,464 @@
+// Replays a job trace (see job_trace.h, and -t in fauxgrep-mt and
+// fhistogram-mt) against other thread counts, queue capacities and
+// scheduling policies, to predict the makespan, the time from the
+// first submission to the last job finishing, before trying them for
+// real.
+//
+// Every job keeps the run time it had in the trace, and is submitted
+// at its traced time, in the traced order.  While the queue is full the
+// submitter waits, and every later submission is delayed by as much.
+// The policies are:
+//
+//   fifo  one queue, oldest job first, as with every job_queue kind
+//         but JOB_QUEUE_PRIORITY;
+//   lpt   one queue, longest job first: the best a priority queue can
+//         do, knowing run times exactly rather than from weights;
+//   ws    one inbox per worker, each of the capacity, filled
+//         round-robin; a worker takes from its own inbox first and
+//         then from the others' in turn, as the work-stealing
+//         scheduler does (but without its random choice of victim).
+//
+// Jobs that ran nested inside others are left out, as their time is
+// part of their parent's.  Run times are taken not to change with the
+// thread count, so predictions are optimistic beyond one thread per
+// CPU, or when jobs compete for memory bandwidth, locks or a disk.
+// Replaying the traced settings with the traced policy shows how far
+// off the model is for a given workload.
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <err.h>
+#include <unistd.h>
+
+#include "job_queue.h"
+#include "job_trace.h"
+
+enum policy { FIFO, LPT, WS };
+
+static char const *const policy_names[] = { "fifo", "lpt", "ws" };
+
+struct job {
+  uint64_t queued;    // since the first submission
+  uint64_t run;
+};
+
+// A bounded ring of job indices
+struct ring {
+  int *slots;
+  int  cap;
+  int  head;
+  int  len;
+};
+
+struct sim {
+  struct job const *jobs;
+  int               njobs;
+  enum policy       policy;
+  int               nthreads;
+  int               capacity;
+  struct ring      *rings;    // one, or one per worker with WS
+  int              *heap;     // LPT: indices, longest run first
+  int               heap_len;
+  unsigned          next_inbox;
+};
+
+struct result {
+  uint64_t makespan;
+  uint64_t wait;      // total time jobs spent queued
+  uint64_t stall;     // total time the submitter waited for room
+};
+
+// ---------- Queues ----------
+
+static int ring_push(struct ring *r, int job) {
+  if (r->len == r->cap) {
+    return -1;
+  }
+  r->slots[(r->head + r->len++) % r->cap] = job;
+  return 0;
+}
+
+static int ring_pop(struct ring *r) {
+  if (r->len == 0) {
+    return -1;
+  }
+  int job = r->slots[r->head];
+  r->head = (r->head + 1) % r->cap;
+  r->len--;
+  return job;
+}
+
+static int longer(struct sim *s, int a, int b) {
+  return s->jobs[s->heap[a]].run > s->jobs[s->heap[b]].run;
+}
+
+static void heap_swap(struct sim *s, int a, int b) {
+  int t = s->heap[a];
+  s->heap[a] = s->heap[b];
+  s->heap[b] = t;
+}
+
+static void heap_push(struct sim *s, int job) {
+  int i = s->heap_len++;
+  s->heap[i] = job;
+  while (i > 0 && longer(s, i, (i - 1) / 2)) {
+    heap_swap(s, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static int heap_pop(struct sim *s) {
+  if (s->heap_len == 0) {
+    return -1;
+  }
+  int job = s->heap[0];
+  s->heap[0] = s->heap[--s->heap_len];
+  int i = 0;
+  for (;;) {
+    int big = i;
+    for (int c = 2 * i + 1; c <= 2 * i + 2 && c < s->heap_len; c++) {
+      if (longer(s, c, big)) {
+        big = c;
+      }
+    }
+    if (big == i) {
+      break;
+    }
+    heap_swap(s, i, big);
+    i = big;
+  }
+  return job;
+}
+
+// Queue a job.  Returns non-zero if there is no room.
+static int submit(struct sim *s, int job) {
+  switch (s->policy) {
+  case FIFO:
+    return ring_push(&s->rings[0], job);
+  case LPT:
+    if (s->heap_len == s->capacity) {
+      return -1;
+    }
+    heap_push(s, job);
+    return 0;
+  case WS:
+    // Like ws_sched_submit(): start at the next inbox, take the
+    // first with room
+    for (int i = 0; i < s->nthreads; i++) {
+      if (ring_push(&s->rings[(s->next_inbox + i) % s->nthreads], job) == 0) {
+        s->next_inbox++;
+        return 0;
+      }
+    }
+    return -1;
+  }
+  return -1;
+}
+
+// The next job for worker 'w', or -1 if there is none.
+static int take(struct sim *s, int w) {
+  switch (s->policy) {
+  case FIFO:
+    return ring_pop(&s->rings[0]);
+  case LPT:
+    return heap_pop(s);
+  case WS:
+    for (int i = 0; i < s->nthreads; i++) {
+      int job = ring_pop(&s->rings[(w + i) % s->nthreads]);
+      if (job >= 0) {
+        return job;
+      }
+    }
+    return -1;
+  }
+  return -1;
+}
+
+// ---------- Simulation ----------
+
+static void simulate(struct job const *jobs, int njobs, enum policy policy,
+                     int nthreads, int capacity, struct result *res) {
+  struct sim s = {
+    .jobs = jobs,
+    .njobs = njobs,
+    .policy = policy,
+    .nthreads = nthreads,
+    .capacity = capacity,
+  };
+  int nrings = policy == WS ? nthreads : policy == FIFO ? 1 : 0;
+  s.rings = calloc(nrings > 0 ? nrings : 1, sizeof(struct ring));
+  s.heap = policy == LPT ? malloc(capacity * sizeof(int)) : NULL;
+  uint64_t *busy_until = calloc(nthreads, sizeof(uint64_t));
+  int *running = malloc(nthreads * sizeof(int));
+  uint64_t *submitted = malloc(njobs * sizeof(uint64_t));
+  if (s.rings == NULL || (policy == LPT && s.heap == NULL) ||
+      busy_until == NULL || running == NULL || submitted == NULL) {
+    err(1, "out of memory");
+  }
+  for (int i = 0; i < nrings; i++) {
+    s.rings[i].cap = capacity;
+    s.rings[i].slots = malloc(capacity * sizeof(int));
+    if (s.rings[i].slots == NULL) {
+      err(1, "out of memory");
+    }
+  }
+  for (int w = 0; w < nthreads; w++) {
+    running[w] = -1;
+  }
+
+  memset(res, 0, sizeof(*res));
+  uint64_t now = 0;
+  uint64_t delay = 0;     // added to traced submission times
+  int next = 0;           // the next job to submit
+  int done = 0;
+  while (done < njobs) {
+    // Submit what is due and start what we can, until neither
+    // makes room for the other
+    for (int progress = 1; progress; ) {
+      progress = 0;
+      while (next < njobs && jobs[next].queued + delay <= now) {
+        if (submit(&s, next) != 0) {
+          break;
+        }
+        // A submission held up for room delays every later one
+        if (jobs[next].queued + delay < now) {
+          res->stall += now - (jobs[next].queued + delay);
+          delay = now - jobs[next].queued;
+        }
+        submitted[next++] = now;
+        progress = 1;
+      }
+      for (int w = 0; w < nthreads; w++) {
+        if (running[w] >= 0) {
+          continue;
+        }
+        int job = take(&s, w);
+        if (job < 0) {
+          continue;
+        }
+        running[w] = job;
+        busy_until[w] = now + jobs[job].run;
+        res->wait += now - submitted[job];
+        progress = 1;
+      }
+    }
+
+    // On to the next submission or finished job.  A submission that
+    // found no room waits for the next job to finish.
+    uint64_t then = UINT64_MAX;
+    if (next < njobs && jobs[next].queued + delay > now) {
+      then = jobs[next].queued + delay;
+    }
+    for (int w = 0; w < nthreads; w++) {
+      if (running[w] >= 0 && busy_until[w] < then) {
+        then = busy_until[w];
+      }
+    }
+    if (then == UINT64_MAX) {
+      errx(1, "simulation stuck");
+    }
+    now = then;
+    for (int w = 0; w < nthreads; w++) {
+      if (running[w] >= 0 && busy_until[w] <= now) {
+        running[w] = -1;
+        done++;
+      }
+    }
+  }
+  res->makespan = now;
+
+  for (int i = 0; i < nrings; i++) {
+    free(s.rings[i].slots);
+  }
+  free(s.rings);
+  free(s.heap);
+  free(busy_until);
+  free(running);
+  free(submitted);
+}
+
+// ---------- Reading the trace ----------
+
+static int by_queued(void const *a, void const *b) {
+  struct job_trace_record const *x = a, *y = b;
+  if (x->queued_ns != y->queued_ns) {
+    return x->queued_ns < y->queued_ns ? -1 : 1;
+  }
+  return x->started_ns < y->started_ns ? -1 : x->started_ns > y->started_ns;
+}
+
+// Read the trace at 'path'.  Returns the jobs, in submission order,
+// and sets '*njobs'; fills in '*header' and what the traced run
+// achieved.
+static struct job *read_trace(char const *path, struct job_trace_header *header,
+                              int *njobs, int *nested, struct result *traced) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    err(1, "cannot open %s", path);
+  }
+  if (fread(header, sizeof(*header), 1, f) != 1 ||
+      memcmp(header->magic, JOB_TRACE_MAGIC, sizeof(header->magic)) != 0) {
+    errx(1, "%s: not a job trace", path);
+  }
+  size_t cap = 1024, n = 0;
+  struct job_trace_record *recs = malloc(cap * sizeof(*recs));
+  if (recs == NULL) {
+    err(1, "out of memory");
+  }
+  *nested = 0;
+  for (;;) {
+    if (n == cap) {
+      cap *= 2;
+      recs = realloc(recs, cap * sizeof(*recs));
+      if (recs == NULL) {
+        err(1, "out of memory");
+      }
+    }
+    if (fread(&recs[n], sizeof(*recs), 1, f) != 1) {
+      break;
+    }
+    if (recs[n].flags & JOB_TRACE_NESTED) {
+      (*nested)++;
+      continue;
+    }
+    n++;
+  }
+  if (ferror(f)) {
+    err(1, "reading %s", path);
+  }
+  fclose(f);
+  if (n == 0) {
+    errx(1, "%s: no jobs", path);
+  }
+
+  qsort(recs, n, sizeof(*recs), by_queued);
+  struct job *jobs = malloc(n * sizeof(struct job));
+  if (jobs == NULL) {
+    err(1, "out of memory");
+  }
+  uint64_t first = recs[0].queued_ns;
+  memset(traced, 0, sizeof(*traced));
+  for (size_t i = 0; i < n; i++) {
+    jobs[i].queued = recs[i].queued_ns - first;
+    jobs[i].run = recs[i].ended_ns - recs[i].started_ns;
+    traced->wait += recs[i].started_ns - recs[i].queued_ns;
+    if (recs[i].ended_ns - first > traced->makespan) {
+      traced->makespan = recs[i].ended_ns - first;
+    }
+  }
+  free(recs);
+  *njobs = n;
+  return jobs;
+}
+
+// ---------- Main ----------
+
+static double ms(uint64_t ns) {
+  return ns / 1e6;
+}
+
+static void print_result(char const *what, int nthreads, char const *policy,
+                         int njobs, struct result const *res, uint64_t traced_makespan) {
+  printf("%-9s %7d  %-6s %12.2f %8.2fx %12.3f %12.2f\n",
+         what, nthreads, policy, ms(res->makespan),
+         (double)traced_makespan / res->makespan,
+         ms(res->wait) / njobs, ms(res->stall));
+}
+
+int main(int argc, char * const *argv) {
+  char const *threads = NULL;
+  char const *policies = "fifo,lpt,ws";
+  int capacity = 0;
+  char const *usage =
+    "usage: [-c CAPACITY] [-n THREADS[,THREADS...]] [-P fifo|lpt|ws[,...]] TRACE";
+  int opt;
+  while ((opt = getopt(argc, argv, "c:n:P:")) != -1) {
+    switch (opt) {
+    case 'c':
+      capacity = atoi(optarg);
+      if (capacity < 1) {
+        errx(1, "invalid capacity: %s", optarg);
+      }
+      break;
+    case 'n':
+      threads = optarg;
+      break;
+    case 'P':
+      policies = optarg;
+      break;
+    default:
+      errx(1, "%s", usage);
+    }
+  }
+  if (optind != argc - 1) {
+    errx(1, "%s", usage);
+  }
+
+  struct job_trace_header header;
+  struct result traced;
+  int njobs, nested;
+  struct job *jobs = read_trace(argv[optind], &header, &njobs, &nested, &traced);
+  if (capacity == 0) {
+    capacity = header.capacity;
+  }
+  uint64_t busy = 0;
+  for (int i = 0; i < njobs; i++) {
+    busy += jobs[i].run;
+  }
+  printf("%d jobs (%d nested left out), %.2f ms of work, traced on %u workers\n"
+         "with capacity %u, batch %u, queue %s; simulating capacity %d\n\n",
+         njobs, nested, ms(busy), header.nworkers, header.capacity, header.batch,
+         job_queue_kind_name(header.kind), capacity);
+  printf("%-9s %7s  %-6s %12s %9s %12s %12s\n",
+         "", "threads", "policy", "makespan ms", "vs traced", "mean wait ms", "stalled ms");
+  print_result("traced", header.nworkers,
+               header.kind == JOB_QUEUE_PRIORITY ? "weight" : "fifo",
+               njobs, &traced, traced.makespan);
+
+  // By default, powers of two up to twice the traced thread count
+  char defaults[256] = "";
+  if (threads == NULL) {
+    size_t len = 0;
+    for (unsigned n = 1; n <= 2 * header.nworkers && len < sizeof(defaults) - 16; n *= 2) {
+      len += snprintf(defaults + len, sizeof(defaults) - len, "%s%u", n > 1 ? "," : "", n);
+    }
+    threads = defaults;
+  }
+  char *tlist = strdup(threads);
+  if (tlist == NULL) {
+    err(1, "out of memory");
+  }
+  for (char *t = strtok(tlist, ","); t != NULL; t = strtok(NULL, ",")) {
+    int nthreads = atoi(t);
+    if (nthreads < 1) {
+      errx(1, "invalid thread count: %s", t);
+    }
+    char *plist = strdup(policies);
+    if (plist == NULL) {
+      err(1, "out of memory");
+    }
+    char *psave;
+    for (char *p = strtok_r(plist, ",", &psave); p != NULL; p = strtok_r(NULL, ",", &psave)) {
+      int policy = -1;
+      for (int i = 0; i < (int)(sizeof(policy_names) / sizeof(*policy_names)); i++) {
+        if (strcmp(p, policy_names[i]) == 0) {
+          policy = i;
+        }
+      }
+      if (policy < 0) {
+        errx(1, "unknown policy: %s", p);
+      }
+      struct result res;
+      simulate(jobs, njobs, policy, nthreads, capacity, &res);
+      print_result("predicted", nthreads, p, njobs, &res, traced.makespan);
+    }
+    free(plist);
+  }
+  free(tlist);
+  free(jobs);
+  return 0;
+}
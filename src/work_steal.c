@@ -0,0 +1,385 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+
+#include "work_steal.h"
+
+#define CACHE_LINE 64
+#define DEQUE_INITIAL_SIZE 64
+
+// ---------- Chase-Lev deque ----------
+//
+// The owner pushes and takes at 'bottom'; thieves take at 'top'.  Only
+// the last element is contended, and that race is settled by a CAS on
+// 'top'.  When the array fills up the owner replaces it by one twice
+// the size.  Thieves may still be reading the old one, so old arrays
+// are kept on a list and freed with the deque.
+
+struct ws_array {
+  long             size;
+  struct ws_array *prev;
+  void            *slots[];
+};
+
+struct ws_deque {
+  long             top;
+  char             pad0[CACHE_LINE - sizeof(long)];
+  long             bottom;
+  struct ws_array *array;
+  char             pad1[CACHE_LINE - sizeof(long) - sizeof(void *)];
+};
+
+// Outcome of a steal attempt.
+enum { STEAL_OK, STEAL_EMPTY, STEAL_LOST };
+
+static struct ws_array *array_new(long size, struct ws_array *prev) {
+  struct ws_array *a = malloc(sizeof(struct ws_array) + size * sizeof(void *));
+  if (a != NULL) {
+    a->size = size;
+    a->prev = prev;
+  }
+  return a;
+}
+
+static int deque_init(struct ws_deque *d) {
+  d->top = 0;
+  d->bottom = 0;
+  d->array = array_new(DEQUE_INITIAL_SIZE, NULL);
+  return d->array == NULL ? -1 : 0;
+}
+
+static void deque_free(struct ws_deque *d) {
+  struct ws_array *a = d->array;
+  while (a != NULL) {
+    struct ws_array *prev = a->prev;
+    free(a);
+    a = prev;
+  }
+}
+
+static int deque_push(struct ws_deque *d, void *job) {
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  struct ws_array *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+  if (b - t > a->size - 1) {
+    struct ws_array *bigger = array_new(a->size * 2, a);
+    if (bigger == NULL) {
+      return -1;
+    }
+    for (long i = t; i < b; i++) {
+      bigger->slots[i % bigger->size] = a->slots[i % a->size];
+    }
+    __atomic_store_n(&d->array, bigger, __ATOMIC_RELEASE);
+    a = bigger;
+  }
+  __atomic_store_n(&a->slots[b % a->size], job, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// Owner only.  Returns 0 and the most recently pushed job, or 1 if
+// the deque is empty.
+static int deque_take(struct ws_deque *d, void **job) {
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+  struct ws_array *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+  __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+  int r = 1;
+  if (t <= b) {
+    *job = __atomic_load_n(&a->slots[b % a->size], __ATOMIC_RELAXED);
+    r = 0;
+    if (t == b) {
+      // Last element: race the thieves for it.
+      if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        r = 1;
+      }
+      __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+  }
+  return r;
+}
+
+// Any thread.  Takes the oldest job.
+static int deque_steal(struct ws_deque *d, void **job) {
+  long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+  if (t >= b) {
+    return STEAL_EMPTY;
+  }
+  struct ws_array *a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+  void *x = __atomic_load_n(&a->slots[t % a->size], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return STEAL_LOST;
+  }
+  *job = x;
+  return STEAL_OK;
+}
+
+// ---------- Workers ----------
+
+struct ws_worker {
+  struct ws_deque  deque;
+  // Submissions from outside land here.  The inbox is a lock-free job
+  // queue that is only ever used without blocking, so that a worker
+  // never sleeps on one particular inbox.
+  struct job_queue inbox;
+  unsigned         rng;
+  int              holding;  // has a popped job that is not finished
+} __attribute__((aligned(CACHE_LINE)));
+
+static int inbox_try_push(struct ws_worker *w, void *job) {
+  return job_queue_try_push(&w->inbox, job);
+}
+
+static int inbox_try_pop(struct ws_worker *w, void **job) {
+  return job_queue_try_pop(&w->inbox, job);
+}
+
+// xorshift32; good enough to pick victims.
+static unsigned next_random(struct ws_worker *w) {
+  unsigned x = w->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return w->rng = x;
+}
+
+int ws_sched_init(struct ws_sched *sched, int nworkers, int capacity) {
+  if (nworkers <= 0 || capacity <= 0) {
+    return -1;
+  }
+  void *mem;
+  if (posix_memalign(&mem, CACHE_LINE, nworkers * sizeof(struct ws_worker)) != 0) {
+    return -1;
+  }
+  sched->workers = mem;
+  struct job_queue_attr attr;
+  job_queue_attr_init(&attr);
+  attr.kind = JOB_QUEUE_LOCKFREE;
+  for (int i = 0; i < nworkers; i++) {
+    struct ws_worker *w = &sched->workers[i];
+    memset(w, 0, sizeof(*w));
+    w->rng = 2463534242u + 7919u * i;
+    if (deque_init(&w->deque) != 0 ||
+        job_queue_init_attr(&w->inbox, capacity, &attr) != 0) {
+      // Nothing can be running yet, so a partial teardown is enough.
+      // Worker i never got an inbox, and its deque array may be NULL.
+      for (int j = 0; j < i; j++) {
+        job_queue_destroy(&sched->workers[j].inbox);
+      }
+      for (int j = 0; j <= i; j++) {
+        deque_free(&sched->workers[j].deque);
+      }
+      free(sched->workers);
+      return -1;
+    }
+  }
+  sched->nworkers = nworkers;
+  sched->next_inbox = 0;
+  sched->pending = 0;
+  sched->closing = 0;
+  sched->done = 0;
+  sched->exited = 0;
+  sched->sleepers = 0;
+  sched->blocked = 0;
+  pthread_mutex_init(&sched->mutex, NULL);
+  pthread_cond_init(&sched->wakeup, NULL);
+  pthread_cond_init(&sched->room, NULL);
+  pthread_cond_init(&sched->idle, NULL);
+  return 0;
+}
+
+// Wake one parked worker, if there is any.  Pairs with the re-check in
+// ws_sched_pop() just as in the job queue parking code.
+static void wake_one(struct ws_sched *sched) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sched->sleepers, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&sched->mutex);
+    pthread_cond_signal(&sched->wakeup);
+    pthread_mutex_unlock(&sched->mutex);
+  }
+}
+
+// Try every inbox once, starting at 'start'.
+static int submit_once(struct ws_sched *sched, unsigned start, void *job) {
+  for (int i = 0; i < sched->nworkers; i++) {
+    struct ws_worker *w = &sched->workers[(start + i) % sched->nworkers];
+    if (inbox_try_push(w, job) == 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int ws_sched_submit(struct ws_sched *sched, void *job) {
+  // Count the job before looking at 'closing'; ws_sched_destroy() does
+  // the opposite, so one of us is bound to notice the other.
+  __atomic_add_fetch(&sched->pending, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sched->closing, __ATOMIC_SEQ_CST)) {
+    if (__atomic_sub_fetch(&sched->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+      pthread_mutex_lock(&sched->mutex);
+      pthread_cond_broadcast(&sched->idle);
+      pthread_mutex_unlock(&sched->mutex);
+    }
+    return -1;
+  }
+  unsigned start = __atomic_fetch_add(&sched->next_inbox, 1, __ATOMIC_RELAXED);
+  while (submit_once(sched, start, job) != 0) {
+    // Every inbox is full.  Sleep until a worker empties a slot.
+    pthread_mutex_lock(&sched->mutex);
+    __atomic_add_fetch(&sched->blocked, 1, __ATOMIC_SEQ_CST);
+    int r = submit_once(sched, start, job);
+    if (r != 0) {
+      pthread_cond_wait(&sched->room, &sched->mutex);
+    }
+    __atomic_sub_fetch(&sched->blocked, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&sched->mutex);
+    if (r == 0) {
+      break;
+    }
+  }
+  wake_one(sched);
+  return 0;
+}
+
+int ws_sched_push(struct ws_sched *sched, int self, void *job) {
+  __atomic_add_fetch(&sched->pending, 1, __ATOMIC_SEQ_CST);
+  if (deque_push(&sched->workers[self].deque, job) != 0) {
+    __atomic_sub_fetch(&sched->pending, 1, __ATOMIC_SEQ_CST);
+    return -1;
+  }
+  wake_one(sched);
+  return 0;
+}
+
+// One pass over every place work can be: own deque, own inbox, then
+// the other workers starting from a random victim.  Returns 0 with a
+// job, 1 if everything looked empty, or 2 if a steal lost a race (so
+// there may be work, and the caller must not go to sleep).
+static int find_work(struct ws_sched *sched, int self, void **job) {
+  struct ws_worker *me = &sched->workers[self];
+  if (deque_take(&me->deque, job) == 0 || inbox_try_pop(me, job) == 0) {
+    return 0;
+  }
+  int r = 1;
+  int n = sched->nworkers;
+  unsigned start = n > 1 ? next_random(me) % n : 0;
+  for (int i = 0; i < n; i++) {
+    struct ws_worker *victim = &sched->workers[(start + i) % n];
+    if (victim == me) {
+      continue;
+    }
+    int s = deque_steal(&victim->deque, job);
+    if (s == STEAL_OK || inbox_try_pop(victim, job) == 0) {
+      return 0;
+    }
+    if (s == STEAL_LOST) {
+      r = 2;
+    }
+  }
+  return r;
+}
+
+// Mark the previously popped job of 'w' as finished.
+static void finish_job(struct ws_sched *sched, struct ws_worker *w) {
+  if (!w->holding) {
+    return;
+  }
+  w->holding = 0;
+  if (__atomic_sub_fetch(&sched->pending, 1, __ATOMIC_SEQ_CST) == 0 &&
+      __atomic_load_n(&sched->closing, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&sched->mutex);
+    pthread_cond_broadcast(&sched->idle);
+    pthread_mutex_unlock(&sched->mutex);
+  }
+}
+
+// A job has been handed to worker 'w'.
+static void got_job(struct ws_sched *sched, struct ws_worker *w) {
+  w->holding = 1;
+  // The job may have come out of an inbox that a submitter is waiting
+  // to push to.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sched->blocked, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&sched->mutex);
+    pthread_cond_broadcast(&sched->room);
+    pthread_mutex_unlock(&sched->mutex);
+  }
+}
+
+int ws_sched_try_pop(struct ws_sched *sched, int self, void **job) {
+  struct ws_worker *me = &sched->workers[self];
+  finish_job(sched, me);
+  int r;
+  while ((r = find_work(sched, self, job)) == 2) {
+  }
+  if (r != 0) {
+    return 1;
+  }
+  got_job(sched, me);
+  return 0;
+}
+
+int ws_sched_pop(struct ws_sched *sched, int self, void **job) {
+  struct ws_worker *me = &sched->workers[self];
+  finish_job(sched, me);
+  for (;;) {
+    int r = find_work(sched, self, job);
+    if (r == 0) {
+      break;
+    }
+    if (r == 2) {
+      continue;
+    }
+    pthread_mutex_lock(&sched->mutex);
+    __atomic_add_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+    r = find_work(sched, self, job);
+    if (r == 1) {
+      if (sched->done) {
+        __atomic_sub_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+        sched->exited++;
+        pthread_cond_broadcast(&sched->idle);
+        pthread_mutex_unlock(&sched->mutex);
+        return -1;
+      }
+      pthread_cond_wait(&sched->wakeup, &sched->mutex);
+    }
+    __atomic_sub_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&sched->mutex);
+    if (r == 0) {
+      break;
+    }
+  }
+  got_job(sched, me);
+  return 0;
+}
+
+int ws_sched_destroy(struct ws_sched *sched) {
+  pthread_mutex_lock(&sched->mutex);
+  __atomic_store_n(&sched->closing, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&sched->pending, __ATOMIC_SEQ_CST) > 0) {
+    pthread_cond_wait(&sched->idle, &sched->mutex);
+  }
+  // All work is finished and none can be added: release the workers
+  // and wait until none of them can touch the deques any more.
+  sched->done = 1;
+  pthread_cond_broadcast(&sched->wakeup);
+  while (sched->exited < sched->nworkers) {
+    pthread_cond_wait(&sched->idle, &sched->mutex);
+  }
+  pthread_mutex_unlock(&sched->mutex);
+  for (int i = 0; i < sched->nworkers; i++) {
+    deque_free(&sched->workers[i].deque);
+    job_queue_destroy(&sched->workers[i].inbox);
+  }
+  free(sched->workers);
+  return 0;
+}
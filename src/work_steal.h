@@ -0,0 +1,71 @@
+#ifndef WORK_STEAL_H
+#define WORK_STEAL_H
+
+// A work-stealing scheduler for a fixed set of worker threads.
+//
+// Every worker owns a Chase-Lev deque, to which it pushes the work it
+// discovers itself and from which it pops in LIFO order, and an inbox
+// that receives work submitted from outside.  A worker that runs dry
+// steals from the top of a randomly chosen victim's deque (or takes
+// from its inbox), so load evens out without any global lock.
+//
+// Unlike a job_queue, the scheduler knows when jobs finish: a worker's
+// call to ws_sched_pop() marks the job it previously popped as done.
+// This lets ws_sched_destroy() wait for work that running jobs may
+// still spawn.
+
+#include <pthread.h>
+
+#include "job_queue.h"
+
+struct ws_array;
+struct ws_worker;
+
+struct ws_sched {
+    int               nworkers;
+    struct ws_worker *workers;
+    unsigned          next_inbox;   // round-robin cursor for submissions
+    long              pending;      // jobs submitted and not yet finished
+    int               closing;      // ws_sched_destroy() has been called
+    int               done;         // no more work will ever arrive
+    int               exited;       // workers that have seen 'done'
+    int               sleepers;     // workers parked on 'wakeup'
+    int               blocked;      // submitters parked on 'room'
+    pthread_mutex_t   mutex;
+    pthread_cond_t    wakeup;       // work arrived, or shutting down
+    pthread_cond_t    room;         // a slot in some inbox was freed
+    pthread_cond_t    idle;         // pending or exited changed
+};
+
+// Initialise a scheduler for 'nworkers' workers, numbered from 0.
+// Each inbox holds up to 'capacity' submitted jobs.  Returns non-zero
+// on error.
+int ws_sched_init(struct ws_sched *sched, int nworkers, int capacity);
+
+// Submit a job from any thread.  Jobs are spread round-robin over the
+// worker inboxes.  Blocks if every inbox is full.  Returns non-zero on
+// error, including when the scheduler is being destroyed.
+int ws_sched_submit(struct ws_sched *sched, void *job);
+
+// Push a job onto the deque of worker 'self'.  May only be called by
+// that worker, typically for sub-work discovered while running a job.
+// Never blocks.  Returns non-zero on error.
+int ws_sched_push(struct ws_sched *sched, int self, void *job);
+
+// Get the next job for worker 'self', which also marks the previous
+// job it popped as finished.  Blocks while there is no work anywhere.
+// Returns -1 once ws_sched_destroy() has been called and all work is
+// finished; the worker must then stop calling into the scheduler.
+int ws_sched_pop(struct ws_sched *sched, int self, void **job);
+
+// Like ws_sched_pop(), but returns 1 instead of blocking when no work
+// can be found.  Never reports shutdown; a worker that gets 1 should
+// fall back on ws_sched_pop() eventually.
+int ws_sched_try_pop(struct ws_sched *sched, int self, void **job);
+
+// Destroy the scheduler.  Blocks until every submitted job, and every
+// job those jobs pushed, has finished, and until all 'nworkers' workers
+// have seen ws_sched_pop() fail.
+int ws_sched_destroy(struct ws_sched *sched);
+
+#endif